@@ -7,6 +7,7 @@ uniform float daylight;
 uniform int ortho;
 
 varying vec2 fragment_uv;
+varying vec2 fragment_tile;
 varying float fragment_ao;
 varying float fragment_light;
 varying float fog_factor;
@@ -16,7 +17,10 @@ varying float diffuse;
 const float pi = 3.14159265;
 
 void main() {
-    vec3 color = vec3(texture2D(sampler, fragment_uv));
+    vec2 tile = floor(fragment_tile + 0.5);
+    vec2 local = clamp(fract(fragment_uv), 1.0 / 128.0, 127.0 / 128.0);
+    vec2 uv = (tile + local) / 16.0;
+    vec3 color = vec3(texture2D(sampler, uv));
     if (color == vec3(1.0, 0.0, 1.0)) {
         discard;
     }
@@ -4,12 +4,15 @@ uniform mat4 matrix;
 uniform vec3 camera;
 uniform float fog_distance;
 uniform int ortho;
+uniform int unpack;
+uniform vec3 origin;
 
 attribute vec4 position;
 attribute vec3 normal;
 attribute vec4 uv;
 
 varying vec2 fragment_uv;
+varying vec2 fragment_tile;
 varying float fragment_ao;
 varying float fragment_light;
 varying float fog_factor;
@@ -20,20 +23,56 @@ const float pi = 3.14159265;
 const vec3 light_direction = normalize(vec3(-1.0, 1.0, -1.0));
 
 void main() {
-    gl_Position = matrix * position;
-    fragment_uv = uv.xy;
-    fragment_ao = 0.3 + (1.0 - uv.z) * 0.7;
-    fragment_light = uv.w;
-    diffuse = max(0.0, dot(normal, light_direction));
+    vec4 world = position;
+    vec3 world_normal = normal;
+    float ao = uv.z;
+    float light = uv.w;
+    if (bool(unpack)) {
+        // see pack_vertices in cube.c for the layout
+        float face = mod(floor(position.x / 1024.0), 8.0);
+        vec3 local = vec3(
+            mod(position.x, 1024.0) / 16.0,
+            mod(position.y, 512.0),
+            mod(position.z, 1024.0) / 16.0);
+        world = vec4(origin + local, 1.0);
+        float tile = mod(position.w, 256.0);
+        fragment_tile = vec2(mod(tile, 16.0), floor(tile / 16.0));
+        if (face < 6.0) {
+            float axis = floor(face / 2.0);
+            world_normal = vec3(equal(vec3(axis), vec3(0.0, 1.0, 2.0))) *
+                (mod(face, 2.0) * 2.0 - 1.0);
+            vec3 n = world_normal;
+            fragment_uv = vec2(
+                (abs(n.y) - n.z) * local.x - n.x * local.z,
+                (1.0 - abs(n.y)) * local.y - n.y * local.z);
+        }
+        else {
+            float angle = floor(position.w / 256.0) * pi / 32.0;
+            world_normal = vec3(cos(angle), 0.0, sin(angle));
+            fragment_uv = vec2(
+                mod(floor(position.x / 8192.0), 2.0),
+                floor(position.x / 16384.0));
+        }
+        ao = floor(position.y / 512.0) / 32.0;
+        light = floor(position.z / 1024.0) / 60.0;
+    }
+    else {
+        fragment_uv = uv.xy;
+        fragment_tile = floor(uv.xy / 64.0);
+    }
+    gl_Position = matrix * world;
+    fragment_ao = 0.3 + (1.0 - ao) * 0.7;
+    fragment_light = light;
+    diffuse = max(0.0, dot(world_normal, light_direction));
     if (bool(ortho)) {
         fog_factor = 0.0;
         fog_height = 0.0;
     }
     else {
-        float camera_distance = distance(camera, vec3(position));
+        float camera_distance = distance(camera, vec3(world));
         fog_factor = pow(clamp(camera_distance / fog_distance, 0.0, 1.0), 4.0);
-        float dy = position.y - camera.y;
-        float dx = distance(position.xz, camera.xz);
+        float dy = world.y - camera.y;
+        float dx = distance(world.xz, camera.xz);
         fog_height = (atan(dy, dx) + pi / 2) / pi;
     }
 }
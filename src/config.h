@@ -25,6 +25,8 @@
 #define SHOW_INFO_TEXT 1
 #define SHOW_CHAT_TEXT 1
 #define SHOW_PLAYER_NAMES 1
+#define GREEDY_MESHING 1
+#define PACKED_VERTICES 1
 
 // key bindings
 #define CRAFT_KEY_FORWARD 'W'
@@ -48,7 +50,17 @@
 #define RENDER_CHUNK_RADIUS 10
 #define RENDER_SIGN_RADIUS 4
 #define DELETE_CHUNK_RADIUS 14
+#define LOD_LEVELS 3
+#define LOD_DISTANCE 8
+#define LOD_HYSTERESIS 2
+#define PREFETCH_TIME 3
+#define PREFETCH_JOBS 4
+#define PREFETCH_LOOK_JOBS 2
+#define FORCE_CHUNK_TIMEOUT 0.05
+#define UPLOAD_BYTES (2 * 1024 * 1024)
+#define UPLOAD_TIME 0.002
 #define CHUNK_SIZE 32
 #define COMMIT_INTERVAL 5
+#define POOL_MAX_RETAINED (64 * 1024 * 1024)
 
 #endif
@@ -4,11 +4,15 @@
 #include "matrix.h"
 #include "util.h"
 
-void make_cube_faces(
-    float *data, float ao[6][4], float light[6][4],
-    int left, int right, int top, int bottom, int front, int back,
-    int wleft, int wright, int wtop, int wbottom, int wfront, int wback,
-    float x, float y, float z, float n)
+// block uvs are in tile space: u = 64 * column + 1 + local u, and the same
+// for v, where local coordinates run from 0 to the face extent in blocks.
+// the fragment shader repeats the tile once per block.
+// faces are quads of four vertices going around the face, drawn as the
+// triangles (0, 1, 2) and (0, 2, 3); starting one corner later splits the
+// quad along the other diagonal, which is how the ao flip is chosen.
+void make_cube_face(
+    float *data, float ao[4], float light[4], int face, int tile,
+    float x, float y, float z, float n, int ex, int ey, int ez)
 {
     static const float positions[6][4][3] = {
         {{-1, -1, -1}, {-1, -1, +1}, {-1, +1, -1}, {-1, +1, +1}},
@@ -34,48 +38,57 @@ void make_cube_faces(
         {{0, 0}, {0, 1}, {1, 0}, {1, 1}},
         {{1, 0}, {1, 1}, {0, 0}, {0, 1}}
     };
-    static const float indices[6][6] = {
-        {0, 3, 2, 0, 1, 3},
-        {0, 3, 1, 0, 2, 3},
-        {0, 3, 2, 0, 1, 3},
-        {0, 3, 1, 0, 2, 3},
-        {0, 3, 2, 0, 1, 3},
-        {0, 3, 1, 0, 2, 3}
+    static const int uv_axes[6][2] = {
+        {2, 1}, {2, 1}, {0, 2}, {0, 2}, {0, 1}, {0, 1}
     };
-    static const float flipped[6][6] = {
-        {0, 1, 2, 1, 3, 2},
-        {0, 2, 1, 2, 3, 1},
-        {0, 1, 2, 1, 3, 2},
-        {0, 2, 1, 2, 3, 1},
-        {0, 1, 2, 1, 3, 2},
-        {0, 2, 1, 2, 3, 1}
+    static const int rings[6][4] = {
+        {0, 1, 3, 2},
+        {0, 2, 3, 1},
+        {0, 1, 3, 2},
+        {0, 2, 3, 1},
+        {0, 1, 3, 2},
+        {0, 2, 3, 1}
     };
     float *d = data;
-    float s = 0.0625;
-    float a = 0 + 1 / 2048.0;
-    float b = s - 1 / 2048.0;
+    float center[3] = {x, y, z};
+    int extent[3] = {ex, ey, ez};
+    float du = (tile % 16) * 64 + 1;
+    float dv = (tile / 16) * 64 + 1;
+    float su = extent[uv_axes[face][0]];
+    float sv = extent[uv_axes[face][1]];
+    int flip = ao[0] + ao[3] > ao[1] + ao[2];
+    for (int v = 0; v < 4; v++) {
+        int j = rings[face][(v + flip) % 4];
+        for (int k = 0; k < 3; k++) {
+            float p = positions[face][j][k];
+            *(d++) = p < 0 ?
+                center[k] - n : center[k] + n + (extent[k] - 1) * 2 * n;
+        }
+        *(d++) = normals[face][0];
+        *(d++) = normals[face][1];
+        *(d++) = normals[face][2];
+        *(d++) = du + uvs[face][j][0] * su;
+        *(d++) = dv + uvs[face][j][1] * sv;
+        *(d++) = ao[j];
+        *(d++) = light[j];
+    }
+}
+
+void make_cube_faces(
+    float *data, float ao[6][4], float light[6][4],
+    int left, int right, int top, int bottom, int front, int back,
+    int wleft, int wright, int wtop, int wbottom, int wfront, int wback,
+    float x, float y, float z, float n)
+{
+    float *d = data;
     int faces[6] = {left, right, top, bottom, front, back};
     int tiles[6] = {wleft, wright, wtop, wbottom, wfront, wback};
     for (int i = 0; i < 6; i++) {
         if (faces[i] == 0) {
             continue;
         }
-        float du = (tiles[i] % 16) * s;
-        float dv = (tiles[i] / 16) * s;
-        int flip = ao[i][0] + ao[i][3] > ao[i][1] + ao[i][2];
-        for (int v = 0; v < 6; v++) {
-            int j = flip ? flipped[i][v] : indices[i][v];
-            *(d++) = x + n * positions[i][j][0];
-            *(d++) = y + n * positions[i][j][1];
-            *(d++) = z + n * positions[i][j][2];
-            *(d++) = normals[i][0];
-            *(d++) = normals[i][1];
-            *(d++) = normals[i][2];
-            *(d++) = du + (uvs[i][j][0] ? b : a);
-            *(d++) = dv + (uvs[i][j][1] ? b : a);
-            *(d++) = ao[i][j];
-            *(d++) = light[i][j];
-        }
+        make_cube_face(d, ao[i], light[i], i, tiles[i], x, y, z, n, 1, 1, 1);
+        d += 40;
     }
 }
 
@@ -119,29 +132,26 @@ void make_plant(
         {{0, 0}, {0, 1}, {1, 0}, {1, 1}},
         {{1, 0}, {1, 1}, {0, 0}, {0, 1}}
     };
-    static const float indices[4][6] = {
-        {0, 3, 2, 0, 1, 3},
-        {0, 3, 1, 0, 2, 3},
-        {0, 3, 2, 0, 1, 3},
-        {0, 3, 1, 0, 2, 3}
+    static const int rings[4][4] = {
+        {0, 1, 3, 2},
+        {0, 2, 3, 1},
+        {0, 1, 3, 2},
+        {0, 2, 3, 1}
     };
     float *d = data;
-    float s = 0.0625;
-    float a = 0;
-    float b = s;
-    float du = (plants[w] % 16) * s;
-    float dv = (plants[w] / 16) * s;
+    float du = (plants[w] % 16) * 64 + 1;
+    float dv = (plants[w] / 16) * 64 + 1;
     for (int i = 0; i < 4; i++) {
-        for (int v = 0; v < 6; v++) {
-            int j = indices[i][v];
+        for (int v = 0; v < 4; v++) {
+            int j = rings[i][v];
             *(d++) = n * positions[i][j][0];
             *(d++) = n * positions[i][j][1];
             *(d++) = n * positions[i][j][2];
             *(d++) = normals[i][0];
             *(d++) = normals[i][1];
             *(d++) = normals[i][2];
-            *(d++) = du + (uvs[i][j][0] ? b : a);
-            *(d++) = dv + (uvs[i][j][1] ? b : a);
+            *(d++) = du + uvs[i][j][0];
+            *(d++) = dv + uvs[i][j][1];
             *(d++) = ao;
             *(d++) = light;
         }
@@ -151,10 +161,59 @@ void make_plant(
     mat_identity(ma);
     mat_rotate(mb, 0, 1, 0, RADIANS(rotation));
     mat_multiply(ma, mb, ma);
-    mat_apply(data, ma, 24, 3, 10);
+    mat_apply(data, ma, 16, 3, 10);
     mat_translate(mb, px, py, pz);
     mat_multiply(ma, mb, ma);
-    mat_apply(data, ma, 24, 0, 10);
+    mat_apply(data, ma, 16, 0, 10);
+}
+
+// packs count chunk vertices in place into four unsigned shorts each,
+// relative to a block aligned origin, see block_vertex.glsl:
+//   x * 16 | face << 10 | corner << 13
+//   y | ao * 32 << 9
+//   z * 16 | light * 60 << 10
+//   tile | angle << 8
+// face is axis * 2 + (normal > 0) for cube faces and 6 for plants, whose
+// normal is stored as one of 64 angles and uvs as a corner; cube uvs are
+// recovered from the position.
+void pack_vertices(float *data, int count, float ox, float oy, float oz) {
+    unsigned short *packed = (unsigned short *)data;
+    for (int i = 0; i < count; i++) {
+        float *d = data + i * 10;
+        int x = roundf((d[0] - ox) * 16);
+        int y = roundf(d[1] - oy);
+        int z = roundf((d[2] - oz) * 16);
+        float nx = d[3];
+        float ny = d[4];
+        float nz = d[5];
+        int column = d[6] / 64;
+        int row = d[7] / 64;
+        int corner_u = d[6] - column * 64 - 1;
+        int corner_v = d[7] - row * 64 - 1;
+        int ao = roundf(d[8] * 32);
+        int light = roundf(MIN(d[9], 1) * 60);
+        int face = 6;
+        int corner = 0;
+        int angle = 0;
+        if (nx == -1 || nx == 1) {
+            face = nx > 0;
+        }
+        else if (ny == -1 || ny == 1) {
+            face = 2 + (ny > 0);
+        }
+        else if (nz == -1 || nz == 1) {
+            face = 4 + (nz > 0);
+        }
+        else {
+            corner = corner_u | (corner_v << 1);
+            angle = (int)roundf(atan2f(nz, nx) / (2 * PI) * 64) & 63;
+        }
+        unsigned short *p = packed + i * 4;
+        p[0] = x | (face << 10) | (corner << 13);
+        p[1] = y | (ao << 9);
+        p[2] = z | (light << 10);
+        p[3] = (row * 16 + column) | (angle << 8);
+    }
 }
 
 void make_player(
@@ -182,10 +241,10 @@ void make_player(
     mat_multiply(ma, mb, ma);
     mat_rotate(mb, cosf(rx), 0, sinf(rx), -ry);
     mat_multiply(ma, mb, ma);
-    mat_apply(data, ma, 36, 3, 10);
+    mat_apply(data, ma, 24, 3, 10);
     mat_translate(mb, x, y, z);
     mat_multiply(ma, mb, ma);
-    mat_apply(data, ma, 36, 0, 10);
+    mat_apply(data, ma, 24, 0, 10);
 }
 
 void make_cube_wireframe(float *data, float x, float y, float z, float n) {
@@ -1,6 +1,10 @@
 #ifndef _cube_h_
 #define _cube_h_
 
+void make_cube_face(
+    float *data, float ao[4], float light[4], int face, int tile,
+    float x, float y, float z, float n, int ex, int ey, int ez);
+
 void make_cube_faces(
     float *data, float ao[6][4], float light[6][4],
     int left, int right, int top, int bottom, int front, int back,
@@ -16,6 +20,8 @@ void make_plant(
     float *data, float ao, float light,
     float px, float py, float pz, float n, int w, float rotation);
 
+void pack_vertices(float *data, int count, float ox, float oy, float oz);
+
 void make_player(
     float *data,
     float x, float y, float z, float rx, float ry);
@@ -14,6 +14,8 @@ static sqlite3_stmt *delete_sign_stmt;
 static sqlite3_stmt *delete_signs_stmt;
 static sqlite3_stmt *load_blocks_stmt;
 static sqlite3_stmt *load_lights_stmt;
+static sqlite3_stmt *count_blocks_stmt;
+static sqlite3_stmt *count_lights_stmt;
 static sqlite3_stmt *load_signs_stmt;
 static sqlite3_stmt *get_key_stmt;
 static sqlite3_stmt *set_key_stmt;
@@ -108,6 +110,10 @@ int db_init(char *path) {
         "select x, y, z, w from block where p = ? and q = ?;";
     static const char *load_lights_query =
         "select x, y, z, w from light where p = ? and q = ?;";
+    static const char *count_blocks_query =
+        "select count(*) from block where p = ? and q = ?;";
+    static const char *count_lights_query =
+        "select count(*) from light where p = ? and q = ?;";
     static const char *load_signs_query =
         "select x, y, z, face, text from sign where p = ? and q = ?;";
     static const char *get_key_query =
@@ -139,6 +145,12 @@ int db_init(char *path) {
     if (rc) return rc;
     rc = sqlite3_prepare_v2(db, load_lights_query, -1, &load_lights_stmt, NULL);
     if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        db, count_blocks_query, -1, &count_blocks_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        db, count_lights_query, -1, &count_lights_stmt, NULL);
+    if (rc) return rc;
     rc = sqlite3_prepare_v2(db, load_signs_query, -1, &load_signs_stmt, NULL);
     if (rc) return rc;
     rc = sqlite3_prepare_v2(db, get_key_query, -1, &get_key_stmt, NULL);
@@ -163,6 +175,8 @@ void db_close() {
     sqlite3_finalize(delete_signs_stmt);
     sqlite3_finalize(load_blocks_stmt);
     sqlite3_finalize(load_lights_stmt);
+    sqlite3_finalize(count_blocks_stmt);
+    sqlite3_finalize(count_lights_stmt);
     sqlite3_finalize(load_signs_stmt);
     sqlite3_finalize(get_key_stmt);
     sqlite3_finalize(set_key_stmt);
@@ -401,11 +415,23 @@ void db_delete_all_signs() {
     sqlite3_exec(db, "delete from sign;", NULL, NULL, NULL);
 }
 
+// makes room in the map for the rows of a chunk once, so that they are
+// set without a growth check each
+void db_reserve(Map *map, sqlite3_stmt *stmt, int p, int q) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p);
+    sqlite3_bind_int(stmt, 2, q);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        map_reserve(map, map->size + sqlite3_column_int(stmt, 0));
+    }
+}
+
 void db_load_blocks(Map *map, int p, int q) {
     if (!db_enabled) {
         return;
     }
     mtx_lock(&load_mtx);
+    db_reserve(map, count_blocks_stmt, p, q);
     sqlite3_reset(load_blocks_stmt);
     sqlite3_bind_int(load_blocks_stmt, 1, p);
     sqlite3_bind_int(load_blocks_stmt, 2, q);
@@ -414,7 +440,7 @@ void db_load_blocks(Map *map, int p, int q) {
         int y = sqlite3_column_int(load_blocks_stmt, 1);
         int z = sqlite3_column_int(load_blocks_stmt, 2);
         int w = sqlite3_column_int(load_blocks_stmt, 3);
-        map_set(map, x, y, z, w);
+        map_set_reserved(map, x, y, z, w);
     }
     mtx_unlock(&load_mtx);
 }
@@ -424,6 +450,7 @@ void db_load_lights(Map *map, int p, int q) {
         return;
     }
     mtx_lock(&load_mtx);
+    db_reserve(map, count_lights_stmt, p, q);
     sqlite3_reset(load_lights_stmt);
     sqlite3_bind_int(load_lights_stmt, 1, p);
     sqlite3_bind_int(load_lights_stmt, 2, q);
@@ -432,7 +459,7 @@ void db_load_lights(Map *map, int p, int q) {
         int y = sqlite3_column_int(load_lights_stmt, 1);
         int z = sqlite3_column_int(load_lights_stmt, 2);
         int w = sqlite3_column_int(load_lights_stmt, 3);
-        map_set(map, x, y, z, w);
+        map_set_reserved(map, x, y, z, w);
     }
     mtx_unlock(&load_mtx);
 }
@@ -1,7 +1,11 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <curl/curl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,14 +19,20 @@
 #include "map.h"
 #include "matrix.h"
 #include "noise.h"
+#include "pool.h"
 #include "sign.h"
+#include "store.h"
 #include "tinycthread.h"
 #include "util.h"
+#include "volume.h"
 #include "world.h"
 
 #define MAX_CHUNKS 8192
+#define CHUNK_INDEX_SIZE (MAX_CHUNKS * 2)
 #define MAX_PLAYERS 128
-#define WORKERS 4
+#define MAX_WORKERS 64
+#define JOBS_PER_WORKER 4
+#define MAX_JOBS (MAX_WORKERS * JOBS_PER_WORKER)
 #define MAX_TEXT_LENGTH 256
 #define MAX_NAME_LENGTH 32
 #define MAX_PATH_LENGTH 256
@@ -35,45 +45,102 @@
 #define MODE_OFFLINE 0
 #define MODE_ONLINE 1
 
-#define WORKER_IDLE 0
-#define WORKER_BUSY 1
-#define WORKER_DONE 2
+#define ALL_SECTIONS ((1 << STORE_SECTIONS) - 1)
+#define PREFETCH_SCORE (1 << 26)
 
 typedef struct {
-    Map map;
+    int x;
+    int y;
+    int z;
+    int w;
+} LightNode;
+
+typedef struct {
+    int capacity;
+    int start;
+    int size;
+    LightNode *data;
+} LightQueue;
+
+// chunks are meshed in the same vertical sections as their block stores
+typedef struct {
+    int faces;
+    int miny;
+    int maxy;
+    GLuint buffer;
+} Mesh;
+
+typedef struct {
+    Store blocks;
     Map lights;
+    Volume light_levels;
     SignList signs;
     int p;
     int q;
+    int loaded;
+    int queued;
+    int lod;
     int faces;
     int sign_faces;
     int dirty;
+    double edited;
     int miny;
     int maxy;
-    GLuint buffer;
+    Mesh meshes[STORE_SECTIONS];
     GLuint sign_buffer;
 } Chunk;
 
 typedef struct {
     int p;
     int q;
+    int epoch;
+    int score;
+    int busy;
+    int cancelled;
+    int prefetch;
     int load;
-    Map *block_maps[3][3];
-    Map *light_maps[3][3];
-    int miny;
-    int maxy;
-    int faces;
+    int loaded;
+    int meshed;
+    int deferred;
+    int lod;
+    int sections;
+    double edited;
+    Store *block_stores[3][3];
+    Volume *light_levels[3][3];
+    Map *light_map;
+    Mesh meshes[STORE_SECTIONS];
     GLfloat *data;
 } WorkerItem;
 
 typedef struct {
-    int index;
-    int state;
     thrd_t thrd;
+} Worker;
+
+// jobs are queued by the main thread, taken best score first by whichever
+// worker is free and handed back through the done list. finished meshes
+// wait in the ready list until they are uploaded. free and ready slots
+// are only touched by the main thread.
+typedef struct {
     mtx_t mtx;
     cnd_t cnd;
-    WorkerItem item;
-} Worker;
+    WorkerItem items[MAX_JOBS];
+    WorkerItem *free[MAX_JOBS];
+    WorkerItem *pending[MAX_JOBS];
+    WorkerItem *done[MAX_JOBS];
+    WorkerItem *ready[MAX_JOBS];
+    int capacity;
+    int free_count;
+    int pending_count;
+    int done_count;
+    int ready_count;
+} JobQueue;
+
+typedef struct {
+    int score;
+    int p;
+    int q;
+    int lod;
+} JobCandidate;
 
 typedef struct {
     int x;
@@ -113,13 +180,20 @@ typedef struct {
     GLuint extra2;
     GLuint extra3;
     GLuint extra4;
+    GLuint extra5;
+    GLuint extra6;
 } Attrib;
 
 typedef struct {
     GLFWwindow *window;
-    Worker workers[WORKERS];
+    Worker workers[MAX_WORKERS];
+    int worker_count;
+    JobQueue jobs;
+    int epoch;
+    float velocity[3];
     Chunk chunks[MAX_CHUNKS];
     int chunk_count;
+    int chunk_index[CHUNK_INDEX_SIZE];
     int create_radius;
     int render_radius;
     int delete_radius;
@@ -151,6 +225,15 @@ typedef struct {
     Block block1;
     Block copy0;
     Block copy1;
+    GLuint quad_buffer;
+    int quad_faces;
+    int edit_count;
+    double edit_latency;
+    double edit_latency_max;
+    int upload_deferred;
+    LightQueue light_queue;
+    LightQueue dark_queue;
+    LightQueue light_seeds;
 } Model;
 
 static Model model;
@@ -160,6 +243,14 @@ int chunked(float x) {
     return floorf(roundf(x) / CHUNK_SIZE);
 }
 
+// block aligned origin for packed chunk vertices, one block outside the
+// chunk so that plants on its border stay in range
+void chunk_origin(float origin[3], int p, int q) {
+    origin[0] = p * CHUNK_SIZE - 1.5;
+    origin[1] = -0.5;
+    origin[2] = q * CHUNK_SIZE - 1.5;
+}
+
 float time_of_day() {
     if (g->day_length <= 0) {
         return 0.5;
@@ -255,7 +346,7 @@ GLuint gen_sky_buffer() {
 }
 
 GLuint gen_cube_buffer(float x, float y, float z, float n, int w) {
-    GLfloat *data = malloc_faces(10, 6);
+    GLfloat *data = malloc_quads(10, 6);
     float ao[6][4] = {0};
     float light[6][4] = {
         {0.5, 0.5, 0.5, 0.5},
@@ -266,21 +357,21 @@ GLuint gen_cube_buffer(float x, float y, float z, float n, int w) {
         {0.5, 0.5, 0.5, 0.5}
     };
     make_cube(data, ao, light, 1, 1, 1, 1, 1, 1, x, y, z, n, w);
-    return gen_faces(10, 6, data);
+    return gen_quads(10, 6, data);
 }
 
 GLuint gen_plant_buffer(float x, float y, float z, float n, int w) {
-    GLfloat *data = malloc_faces(10, 4);
+    GLfloat *data = malloc_quads(10, 4);
     float ao = 0;
     float light = 1;
     make_plant(data, ao, light, x, y, z, n, w, 45);
-    return gen_faces(10, 4, data);
+    return gen_quads(10, 4, data);
 }
 
 GLuint gen_player_buffer(float x, float y, float z, float rx, float ry) {
-    GLfloat *data = malloc_faces(10, 6);
+    GLfloat *data = malloc_quads(10, 6);
     make_player(data, x, y, z, rx, ry);
-    return gen_faces(10, 6, data);
+    return gen_quads(10, 6, data);
 }
 
 GLuint gen_text_buffer(float x, float y, float n, char *text) {
@@ -293,7 +384,21 @@ GLuint gen_text_buffer(float x, float y, float n, char *text) {
     return gen_faces(4, length, data);
 }
 
-void draw_triangles_3d_ao(Attrib *attrib, GLuint buffer, int count) {
+void bind_quad_indices(int faces) {
+    if (faces > g->quad_faces) {
+        int capacity = MAX(g->quad_faces, 4096);
+        while (capacity < faces) {
+            capacity *= 2;
+        }
+        del_buffer(g->quad_buffer);
+        g->quad_buffer = gen_quad_indices(capacity);
+        g->quad_faces = capacity;
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g->quad_buffer);
+}
+
+void draw_quads_3d_ao(Attrib *attrib, GLuint buffer, int faces) {
+    bind_quad_indices(faces);
     glBindBuffer(GL_ARRAY_BUFFER, buffer);
     glEnableVertexAttribArray(attrib->position);
     glEnableVertexAttribArray(attrib->normal);
@@ -304,11 +409,24 @@ void draw_triangles_3d_ao(Attrib *attrib, GLuint buffer, int count) {
         sizeof(GLfloat) * 10, (GLvoid *)(sizeof(GLfloat) * 3));
     glVertexAttribPointer(attrib->uv, 4, GL_FLOAT, GL_FALSE,
         sizeof(GLfloat) * 10, (GLvoid *)(sizeof(GLfloat) * 6));
-    glDrawArrays(GL_TRIANGLES, 0, count);
+    glDrawElements(GL_TRIANGLES, faces * 6, GL_UNSIGNED_INT, 0);
     glDisableVertexAttribArray(attrib->position);
     glDisableVertexAttribArray(attrib->normal);
     glDisableVertexAttribArray(attrib->uv);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void draw_quads_3d_packed(Attrib *attrib, GLuint buffer, int faces) {
+    bind_quad_indices(faces);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableVertexAttribArray(attrib->position);
+    glVertexAttribPointer(attrib->position, 4, GL_UNSIGNED_SHORT, GL_FALSE,
+        sizeof(GLushort) * 4, 0);
+    glDrawElements(GL_TRIANGLES, faces * 6, GL_UNSIGNED_INT, 0);
+    glDisableVertexAttribArray(attrib->position);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 void draw_triangles_3d_text(Attrib *attrib, GLuint buffer, int count) {
@@ -367,12 +485,20 @@ void draw_lines(Attrib *attrib, GLuint buffer, int components, int count) {
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void draw_chunk(Attrib *attrib, Chunk *chunk) {
-    draw_triangles_3d_ao(attrib, chunk->buffer, chunk->faces * 6);
+void draw_mesh(Attrib *attrib, Chunk *chunk, Mesh *mesh) {
+    if (PACKED_VERTICES) {
+        float origin[3];
+        chunk_origin(origin, chunk->p, chunk->q);
+        glUniform3fv(attrib->extra6, 1, origin);
+        draw_quads_3d_packed(attrib, mesh->buffer, mesh->faces);
+    }
+    else {
+        draw_quads_3d_ao(attrib, mesh->buffer, mesh->faces);
+    }
 }
 
-void draw_item(Attrib *attrib, GLuint buffer, int count) {
-    draw_triangles_3d_ao(attrib, buffer, count);
+void draw_item(Attrib *attrib, GLuint buffer, int faces) {
+    draw_quads_3d_ao(attrib, buffer, faces);
 }
 
 void draw_text(Attrib *attrib, GLuint buffer, int length) {
@@ -397,11 +523,11 @@ void draw_sign(Attrib *attrib, GLuint buffer, int length) {
 }
 
 void draw_cube(Attrib *attrib, GLuint buffer) {
-    draw_item(attrib, buffer, 36);
+    draw_item(attrib, buffer, 6);
 }
 
 void draw_plant(Attrib *attrib, GLuint buffer) {
-    draw_item(attrib, buffer, 24);
+    draw_item(attrib, buffer, 4);
 }
 
 void draw_player(Attrib *attrib, Player *player) {
@@ -525,14 +651,54 @@ Player *player_crosshair(Player *player) {
     return result;
 }
 
-Chunk *find_chunk(int p, int q) {
-    for (int i = 0; i < g->chunk_count; i++) {
-        Chunk *chunk = g->chunks + i;
+unsigned int chunk_hash(int p, int q) {
+    unsigned int h = (unsigned int)p * 0x9e3779b1u + (unsigned int)q;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h & (CHUNK_INDEX_SIZE - 1);
+}
+
+int *find_chunk_slot(int p, int q) {
+    unsigned int index = chunk_hash(p, q);
+    int *slot = g->chunk_index + index;
+    while (*slot) {
+        Chunk *chunk = g->chunks + *slot - 1;
         if (chunk->p == p && chunk->q == q) {
-            return chunk;
+            break;
         }
+        index = (index + 1) & (CHUNK_INDEX_SIZE - 1);
+        slot = g->chunk_index + index;
     }
-    return 0;
+    return slot;
+}
+
+Chunk *find_chunk(int p, int q) {
+    int *slot = find_chunk_slot(p, q);
+    return *slot ? g->chunks + *slot - 1 : 0;
+}
+
+void index_chunk(Chunk *chunk) {
+    *find_chunk_slot(chunk->p, chunk->q) = chunk - g->chunks + 1;
+}
+
+void unindex_chunk(Chunk *chunk) {
+    int mask = CHUNK_INDEX_SIZE - 1;
+    int i = find_chunk_slot(chunk->p, chunk->q) - g->chunk_index;
+    int j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!g->chunk_index[j]) {
+            break;
+        }
+        Chunk *other = g->chunks + g->chunk_index[j] - 1;
+        int k = chunk_hash(other->p, other->q);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            g->chunk_index[i] = g->chunk_index[j];
+            i = j;
+        }
+    }
+    g->chunk_index[i] = 0;
 }
 
 int chunk_distance(Chunk *chunk, int p, int q) {
@@ -541,6 +707,21 @@ int chunk_distance(Chunk *chunk, int p, int q) {
     return MAX(dp, dq);
 }
 
+// chunks are meshed coarser every time their distance doubles. they only
+// switch to a coarser level LOD_HYSTERESIS chunks past the boundary, so
+// moving back and forth across a boundary does not remesh them each time.
+int chunk_lod(int lod, int distance) {
+    while (lod > 0 && distance < LOD_DISTANCE << (lod - 1)) {
+        lod--;
+    }
+    while (lod < LOD_LEVELS - 1 &&
+        distance >= (LOD_DISTANCE << lod) + LOD_HYSTERESIS)
+    {
+        lod++;
+    }
+    return lod;
+}
+
 int chunk_visible(float planes[6][4], int p, int q, int miny, int maxy) {
     int x = p * CHUNK_SIZE - 1;
     int z = q * CHUNK_SIZE - 1;
@@ -590,18 +771,13 @@ int highest_block(float x, float z) {
     int q = chunked(z);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
-        Map *map = &chunk->map;
-        MAP_FOR_EACH(map, ex, ey, ez, ew) {
-            if (is_obstacle(ew) && ex == nx && ez == nz) {
-                result = MAX(result, ey);
-            }
-        } END_MAP_FOR_EACH;
+        result = store_obstacle_height(&chunk->blocks, nx, nz);
     }
     return result;
 }
 
 int _hit_test(
-    Map *map, float max_distance, int previous,
+    Store *store, float max_distance, int previous,
     float x, float y, float z,
     float vx, float vy, float vz,
     int *hx, int *hy, int *hz)
@@ -615,7 +791,7 @@ int _hit_test(
         int ny = roundf(y);
         int nz = roundf(z);
         if (nx != px || ny != py || nz != pz) {
-            int hw = map_get(map, nx, ny, nz);
+            int hw = store_get(store, nx, ny, nz);
             if (hw > 0) {
                 if (previous) {
                     *hx = px; *hy = py; *hz = pz;
@@ -648,7 +824,7 @@ int hit_test(
             continue;
         }
         int hx, hy, hz;
-        int hw = _hit_test(&chunk->map, 8, previous,
+        int hw = _hit_test(&chunk->blocks, 8, previous,
             x, y, z, vx, vy, vz, &hx, &hy, &hz);
         if (hw > 0) {
             float d = sqrtf(
@@ -704,7 +880,7 @@ int collide(int height, float *x, float *y, float *z) {
     if (!chunk) {
         return result;
     }
-    Map *map = &chunk->map;
+    Store *store = &chunk->blocks;
     int nx = roundf(*x);
     int ny = roundf(*y);
     int nz = roundf(*z);
@@ -713,24 +889,24 @@ int collide(int height, float *x, float *y, float *z) {
     float pz = *z - nz;
     float pad = 0.25;
     for (int dy = 0; dy < height; dy++) {
-        if (px < -pad && is_obstacle(map_get(map, nx - 1, ny - dy, nz))) {
+        if (px < -pad && is_obstacle(store_get(store, nx - 1, ny - dy, nz))) {
             *x = nx - pad;
         }
-        if (px > pad && is_obstacle(map_get(map, nx + 1, ny - dy, nz))) {
+        if (px > pad && is_obstacle(store_get(store, nx + 1, ny - dy, nz))) {
             *x = nx + pad;
         }
-        if (py < -pad && is_obstacle(map_get(map, nx, ny - dy - 1, nz))) {
+        if (py < -pad && is_obstacle(store_get(store, nx, ny - dy - 1, nz))) {
             *y = ny - pad;
             result = 1;
         }
-        if (py > pad && is_obstacle(map_get(map, nx, ny - dy + 1, nz))) {
+        if (py > pad && is_obstacle(store_get(store, nx, ny - dy + 1, nz))) {
             *y = ny + pad;
             result = 1;
         }
-        if (pz < -pad && is_obstacle(map_get(map, nx, ny - dy, nz - 1))) {
+        if (pz < -pad && is_obstacle(store_get(store, nx, ny - dy, nz - 1))) {
             *z = nz - pad;
         }
-        if (pz > pad && is_obstacle(map_get(map, nx, ny - dy, nz + 1))) {
+        if (pz > pad && is_obstacle(store_get(store, nx, ny - dy, nz + 1))) {
             *z = nz + pad;
         }
     }
@@ -818,77 +994,381 @@ int _gen_sign_buffer(
 
 void gen_sign_buffer(Chunk *chunk) {
     SignList *signs = &chunk->signs;
-
-    // first pass - count characters
-    int max_faces = 0;
+    FaceBuffer buffer;
+    face_buffer_alloc(&buffer, 5, 6, 64);
     for (int i = 0; i < signs->size; i++) {
         Sign *e = signs->data + i;
-        max_faces += strlen(e->text);
+        GLfloat *data = face_buffer_reserve(&buffer, MAX_SIGN_LENGTH);
+        buffer.size += _gen_sign_buffer(
+            data, e->x, e->y, e->z, e->face, e->text);
     }
+    del_buffer(chunk->sign_buffer);
+    chunk->sign_buffer = gen_faces(5, buffer.size, buffer.data);
+    chunk->sign_faces = buffer.size;
+}
 
-    // second pass - generate geometry
-    GLfloat *data = malloc_faces(5, max_faces);
-    int faces = 0;
-    for (int i = 0; i < signs->size; i++) {
-        Sign *e = signs->data + i;
-        faces += _gen_sign_buffer(
-            data + faces * 30, e->x, e->y, e->z, e->face, e->text);
+int section_mask(int miny, int maxy) {
+    miny = MAX(miny, 0) / SECTION_Y;
+    maxy = MIN(maxy, STORE_HEIGHT - 1) / SECTION_Y;
+    return ((2 << maxy) - 1) & ~((1 << miny) - 1);
+}
+
+void dirty_sections(Chunk *chunk, int mask, int edit) {
+    chunk->dirty |= mask;
+    if (edit && !chunk->edited) {
+        chunk->edited = glfwGetTime();
     }
+}
 
-    del_buffer(chunk->sign_buffer);
-    chunk->sign_buffer = gen_faces(5, faces, data);
-    chunk->sign_faces = faces;
+void dirty_chunk(Chunk *chunk) {
+    dirty_sections(chunk, ALL_SECTIONS, 0);
 }
 
-int has_lights(Chunk *chunk) {
-    if (!SHOW_LIGHTS) {
+void dirty_block(Chunk *chunk, int y) {
+    // a block changes the faces and ao of its neighbors and the shading
+    // of the blocks up to 8 below it. light is dirtied where it changes.
+    dirty_sections(chunk, section_mask(y - 8, y + 1), 1);
+}
+
+static const int light_offsets[6][3] = {
+    {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}
+};
+
+void light_queue_push(LightQueue *queue, int x, int y, int z, int w) {
+    if (queue->size == queue->capacity) {
+        int capacity = MAX(queue->capacity, 2048) * 2;
+        LightNode *data = (LightNode *)malloc(capacity * sizeof(LightNode));
+        for (int i = 0; i < queue->size; i++) {
+            data[i] = queue->data[
+                (queue->start + i) & (queue->capacity - 1)];
+        }
+        free(queue->data);
+        queue->data = data;
+        queue->capacity = capacity;
+        queue->start = 0;
+    }
+    LightNode *e = queue->data +
+        ((queue->start + queue->size++) & (queue->capacity - 1));
+    e->x = x;
+    e->y = y;
+    e->z = z;
+    e->w = w;
+}
+
+LightNode light_queue_pop(LightQueue *queue) {
+    LightNode e = queue->data[queue->start];
+    queue->start = (queue->start + 1) & (queue->capacity - 1);
+    queue->size--;
+    return e;
+}
+
+Chunk *find_light_chunk(int x, int y, int z) {
+    if (y < 0 || y >= STORE_HEIGHT) {
         return 0;
     }
-    for (int dp = -1; dp <= 1; dp++) {
-        for (int dq = -1; dq <= 1; dq++) {
+    Chunk *chunk = find_chunk(chunked(x), chunked(z));
+    return chunk && chunk->loaded ? chunk : 0;
+}
+
+int is_light_opaque(Chunk *chunk, int x, int y, int z) {
+    return !is_transparent(store_get(&chunk->blocks, x, y, z));
+}
+
+void put_light_level(Chunk *chunk, int x, int y, int z, int w, int edit) {
+    if (!volume_set(&chunk->light_levels, x, y, z, w)) {
+        return;
+    }
+    // the ao of the neighbors across a chunk border samples this voxel too
+    int mask = section_mask(y - 1, y + 1);
+    int lx = x - chunk->p * CHUNK_SIZE;
+    int lz = z - chunk->q * CHUNK_SIZE;
+    int p0 = lx == 0 ? -1 : 0;
+    int p1 = lx == CHUNK_SIZE - 1 ? 1 : 0;
+    int q0 = lz == 0 ? -1 : 0;
+    int q1 = lz == CHUNK_SIZE - 1 ? 1 : 0;
+    for (int dp = p0; dp <= p1; dp++) {
+        for (int dq = q0; dq <= q1; dq++) {
             Chunk *other = chunk;
             if (dp || dq) {
                 other = find_chunk(chunk->p + dp, chunk->q + dq);
             }
+            if (other) {
+                dirty_sections(other, mask, edit);
+            }
+        }
+    }
+}
+
+void light_spread(int x, int y, int z, int w, int force, int edit) {
+    Chunk *chunk = find_light_chunk(x, y, z);
+    if (!chunk) {
+        return;
+    }
+    if (volume_get(&chunk->light_levels, x, y, z) >= w) {
+        return;
+    }
+    if (!force && is_light_opaque(chunk, x, y, z)) {
+        return;
+    }
+    put_light_level(chunk, x, y, z, w, edit);
+    light_queue_push(&g->light_queue, x, y, z, w);
+}
+
+int light_seed_compare(const void *a, const void *b) {
+    return ((LightNode *)b)->w - ((LightNode *)a)->w;
+}
+
+// breadth first flood fill from the collected seeds: light sources and
+// voxels whose light has to spread again. the queue holds one intensity
+// level followed by the next lower one, and seeds join it when their
+// level comes up, so every voxel is only lit once.
+void light_fill(int edit) {
+    LightQueue *queue = &g->light_queue;
+    LightNode *seeds = g->light_seeds.data;
+    int count = g->light_seeds.size;
+    qsort(seeds, count, sizeof(LightNode), light_seed_compare);
+    int next = 0;
+    while (queue->size || next < count) {
+        int level = queue->size ? queue->data[queue->start].w : seeds[next].w;
+        while (next < count && seeds[next].w >= level) {
+            LightNode *e = seeds + next++;
+            Chunk *chunk = find_light_chunk(e->x, e->y, e->z);
+            if (!chunk) {
+                continue;
+            }
+            // sources are forced in, voxels that were to spread again
+            // are skipped if their light was cleared in the meantime
+            int w = volume_get(&chunk->light_levels, e->x, e->y, e->z);
+            if (w == e->w) {
+                light_queue_push(queue, e->x, e->y, e->z, e->w);
+            }
+            else if (map_get(&chunk->lights, e->x, e->y, e->z) >= e->w) {
+                light_spread(e->x, e->y, e->z, e->w, 1, edit);
+            }
+        }
+        if (!queue->size) {
+            continue;
+        }
+        LightNode e = light_queue_pop(queue);
+        int w = e.w - 1;
+        light_spread(e.x - 1, e.y, e.z, w, 0, edit);
+        light_spread(e.x + 1, e.y, e.z, w, 0, edit);
+        light_spread(e.x, e.y - 1, e.z, w, 0, edit);
+        light_spread(e.x, e.y + 1, e.z, w, 0, edit);
+        light_spread(e.x, e.y, e.z - 1, w, 0, edit);
+        light_spread(e.x, e.y, e.z + 1, w, 0, edit);
+    }
+    g->light_seeds.size = 0;
+}
+
+void light_seed(int x, int y, int z, int w) {
+    light_queue_push(&g->light_seeds, x, y, z, w);
+}
+
+// clears the light that spread from the voxels in the dark queue and
+// collects the sources and the light around them that has to spread again
+void light_darken(int edit) {
+    LightQueue *queue = &g->dark_queue;
+    while (queue->size) {
+        LightNode e = light_queue_pop(queue);
+        Chunk *chunk = find_light_chunk(e.x, e.y, e.z);
+        int source = chunk ? map_get(&chunk->lights, e.x, e.y, e.z) : 0;
+        if (source > 0) {
+            light_seed(e.x, e.y, e.z, source);
+        }
+        for (int i = 0; i < 6; i++) {
+            int nx = e.x + light_offsets[i][0];
+            int ny = e.y + light_offsets[i][1];
+            int nz = e.z + light_offsets[i][2];
+            Chunk *other = find_light_chunk(nx, ny, nz);
             if (!other) {
                 continue;
             }
-            Map *map = &other->lights;
-            if (map->size) {
-                return 1;
+            int nw = volume_get(&other->light_levels, nx, ny, nz);
+            if (!nw) {
+                continue;
+            }
+            if (nw < e.w) {
+                put_light_level(other, nx, ny, nz, 0, edit);
+                light_queue_push(queue, nx, ny, nz, nw);
+            }
+            else {
+                light_seed(nx, ny, nz, nw);
             }
         }
     }
-    return 0;
 }
 
-void dirty_chunk(Chunk *chunk) {
-    chunk->dirty = 1;
-    if (has_lights(chunk)) {
-        for (int dp = -1; dp <= 1; dp++) {
-            for (int dq = -1; dq <= 1; dq++) {
-                Chunk *other = find_chunk(chunk->p + dp, chunk->q + dq);
-                if (other) {
-                    other->dirty = 1;
+// clears the light that came through a voxel, then relights the cleared
+// voxels from the light around them and from the sources among them
+void light_remove(int x, int y, int z, int edit) {
+    Chunk *chunk = find_light_chunk(x, y, z);
+    if (!chunk) {
+        return;
+    }
+    int w = volume_get(&chunk->light_levels, x, y, z);
+    if (w) {
+        put_light_level(chunk, x, y, z, 0, edit);
+        light_queue_push(&g->dark_queue, x, y, z, w);
+        light_darken(edit);
+    }
+    light_fill(edit);
+}
+
+void light_add(int x, int y, int z, int w, int edit) {
+    light_seed(x, y, z, w);
+    light_fill(edit);
+}
+
+// a voxel that stops blocking light is lit again by its neighbors
+void light_open(int x, int y, int z, int edit) {
+    for (int i = 0; i < 6; i++) {
+        int nx = x + light_offsets[i][0];
+        int ny = y + light_offsets[i][1];
+        int nz = z + light_offsets[i][2];
+        Chunk *chunk = find_light_chunk(nx, ny, nz);
+        if (chunk) {
+            int w = volume_get(&chunk->light_levels, nx, ny, nz);
+            if (w > 1) {
+                light_seed(nx, ny, nz, w);
+            }
+        }
+    }
+    light_fill(edit);
+}
+
+// floods the sources of a chunk that just loaded and the light that
+// reaches into it from its neighbors
+void light_chunk(Chunk *chunk) {
+    if (!SHOW_LIGHTS) {
+        return;
+    }
+    Map *map = &chunk->lights;
+    MAP_FOR_EACH(map, ex, ey, ez, ew) {
+        if (ew > 0) {
+            light_seed(ex, ey, ez, ew);
+        }
+    } END_MAP_FOR_EACH;
+    static const int sides[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    for (int i = 0; i < 4; i++) {
+        int dp = sides[i][0];
+        int dq = sides[i][1];
+        Chunk *other = find_chunk(chunk->p + dp, chunk->q + dq);
+        if (!other || !other->loaded || !other->light_levels.size) {
+            continue;
+        }
+        Volume *volume = &other->light_levels;
+        for (int s = 0; s < STORE_SECTIONS; s++) {
+            if (!volume->sections[s]) {
+                continue;
+            }
+            for (int y = s * SECTION_Y; y < (s + 1) * SECTION_Y; y++) {
+                for (int j = 0; j < CHUNK_SIZE; j++) {
+                    // the column of the neighbor along the shared border
+                    int x = dp < 0 ? -1 : dp > 0 ? CHUNK_SIZE : j;
+                    int z = dq < 0 ? -1 : dq > 0 ? CHUNK_SIZE : j;
+                    x += chunk->p * CHUNK_SIZE;
+                    z += chunk->q * CHUNK_SIZE;
+                    int w = volume_get(volume, x, y, z);
+                    if (w > 1) {
+                        light_seed(x, y, z, w);
+                    }
                 }
             }
         }
     }
+    light_fill(0);
+}
+
+// queues the light that spread out of a chunk about to be deleted to be
+// taken back out of its neighbors by light_darken. light_chunk seeds a
+// chunk that loads again from their borders, which must not bring back
+// sources removed while it was away.
+void light_unload(Chunk *chunk) {
+    if (!chunk->loaded) {
+        return;
+    }
+    chunk->loaded = 0;
+    if (!SHOW_LIGHTS || !chunk->light_levels.size) {
+        return;
+    }
+    Volume *volume = &chunk->light_levels;
+    int x0 = chunk->p * CHUNK_SIZE;
+    int z0 = chunk->q * CHUNK_SIZE;
+    for (int s = 0; s < STORE_SECTIONS; s++) {
+        if (!volume->sections[s]) {
+            continue;
+        }
+        for (int y = s * SECTION_Y; y < (s + 1) * SECTION_Y; y++) {
+            for (int j = 0; j < CHUNK_SIZE; j++) {
+                // the voxels along the four sides of the chunk
+                int border[4][2] = {
+                    {0, j}, {CHUNK_SIZE - 1, j}, {j, 0}, {j, CHUNK_SIZE - 1}
+                };
+                for (int i = 0; i < 4; i++) {
+                    int x = x0 + border[i][0];
+                    int z = z0 + border[i][1];
+                    int w = volume_get(volume, x, y, z);
+                    if (w > 1) {
+                        light_queue_push(&g->dark_queue, x, y, z, w);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// the ao levels of the four corners of a face, two bits each, for every
+// combination of opaque blocks in the 3x3 layer in front of the face
+#define AO_BIT(k, i) (((k) >> (i)) & 1)
+#define AO_LEVEL(k, corner, side1, side2) \
+    (AO_BIT(k, side1) && AO_BIT(k, side2) ? 3 : \
+    AO_BIT(k, corner) + AO_BIT(k, side1) + AO_BIT(k, side2))
+#define AO_ENTRY(k) ( \
+    AO_LEVEL(k, 0, 1, 3) | AO_LEVEL(k, 2, 1, 5) << 2 | \
+    AO_LEVEL(k, 6, 3, 7) << 4 | AO_LEVEL(k, 8, 5, 7) << 6)
+#define AO_ENTRY4(k) \
+    AO_ENTRY(k), AO_ENTRY(k + 1), AO_ENTRY(k + 2), AO_ENTRY(k + 3)
+#define AO_ENTRY16(k) \
+    AO_ENTRY4(k), AO_ENTRY4(k + 4), AO_ENTRY4(k + 8), AO_ENTRY4(k + 12)
+#define AO_ENTRY64(k) \
+    AO_ENTRY16(k), AO_ENTRY16(k + 16), AO_ENTRY16(k + 32), \
+    AO_ENTRY16(k + 48)
+#define AO_ENTRY256(k) \
+    AO_ENTRY64(k), AO_ENTRY64(k + 64), AO_ENTRY64(k + 128), \
+    AO_ENTRY64(k + 192)
+
+static const unsigned char ao_levels[512] = {
+    AO_ENTRY256(0), AO_ENTRY256(256)
+};
+
+// gathers the 3x3 layer of neighbors in front of a face from the mask of
+// all 27 neighbors, which has bit (dx * 9 + dy * 3 + dz) set when opaque
+int occlusion_layer(int neighbors, int face) {
+    int dy = face == 2 ? 2 : 0;
+    int bits;
+    switch (face) {
+        case 0: return neighbors & 511;
+        case 1: return (neighbors >> 18) & 511;
+        case 2: case 3:
+            return ((neighbors >> (dy * 3)) & 7) |
+                ((neighbors >> (9 + dy * 3)) & 7) << 3 |
+                ((neighbors >> (18 + dy * 3)) & 7) << 6;
+        default:
+            // every third bit, starting at dz
+            bits = (neighbors >> (face - 4) * 2) & 0x1249249;
+            bits = (bits ^ (bits >> 2)) & 0x30c30c3;
+            bits = (bits ^ (bits >> 4)) & 0x300f00f;
+            bits = (bits ^ (bits >> 8)) & 0xff0000ff;
+            return (bits ^ (bits >> 16)) & 511;
+    }
 }
 
 void occlusion(
-    char neighbors[27], char lights[27], float shades[27],
+    int neighbors, char lights[27], float shades[27],
     float ao[6][4], float light[6][4])
 {
-    static const int lookup3[6][4][3] = {
-        {{0, 1, 3}, {2, 1, 5}, {6, 3, 7}, {8, 5, 7}},
-        {{18, 19, 21}, {20, 19, 23}, {24, 21, 25}, {26, 23, 25}},
-        {{6, 7, 15}, {8, 7, 17}, {24, 15, 25}, {26, 17, 25}},
-        {{0, 1, 9}, {2, 1, 11}, {18, 9, 19}, {20, 11, 19}},
-        {{0, 3, 9}, {6, 3, 15}, {18, 9, 21}, {24, 15, 21}},
-        {{2, 5, 11}, {8, 5, 17}, {20, 11, 23}, {26, 17, 23}}
-    };
-   static const int lookup4[6][4][4] = {
+    static const int lookup4[6][4][4] = {
         {{0, 1, 3, 4}, {1, 2, 4, 5}, {3, 4, 6, 7}, {4, 5, 7, 8}},
         {{18, 19, 21, 22}, {19, 20, 22, 23}, {21, 22, 24, 25}, {22, 23, 25, 26}},
         {{6, 7, 15, 16}, {7, 8, 16, 17}, {15, 16, 24, 25}, {16, 17, 25, 26}},
@@ -897,25 +1377,24 @@ void occlusion(
         {{2, 5, 11, 14}, {5, 8, 14, 17}, {11, 14, 20, 23}, {14, 17, 23, 26}}
     };
     static const float curve[4] = {0.0, 0.25, 0.5, 0.75};
+    int is_light = lights[13] == 15;
     for (int i = 0; i < 6; i++) {
-        for (int j = 0; j < 4; j++) {
-            int corner = neighbors[lookup3[i][j][0]];
-            int side1 = neighbors[lookup3[i][j][1]];
-            int side2 = neighbors[lookup3[i][j][2]];
-            int value = side1 && side2 ? 3 : corner + side1 + side2;
-            float shade_sum = 0;
-            float light_sum = 0;
-            int is_light = lights[13] == 15;
-            for (int k = 0; k < 4; k++) {
-                shade_sum += shades[lookup4[i][j][k]];
-                light_sum += lights[lookup4[i][j][k]];
+        int levels = ao_levels[occlusion_layer(neighbors, i)];
+        float shade_sum[4] = {0};
+        float light_sum[4] = {0};
+        for (int k = 0; k < 4; k++) {
+            for (int j = 0; j < 4; j++) {
+                shade_sum[j] += shades[lookup4[i][j][k]];
+                light_sum[j] += lights[lookup4[i][j][k]];
             }
+        }
+        for (int j = 0; j < 4; j++) {
             if (is_light) {
-                light_sum = 15 * 4 * 10;
+                light_sum[j] = 15 * 4 * 10;
             }
-            float total = curve[value] + shade_sum / 4.0;
+            float total = curve[(levels >> (j * 2)) & 3] + shade_sum[j] / 4.0;
             ao[i][j] = MIN(total, 1.0);
-            light[i][j] = light_sum / 15.0 / 4.0;
+            light[i][j] = light_sum[j] / 15.0 / 4.0;
         }
     }
 }
@@ -926,65 +1405,418 @@ void occlusion(
 #define Y_SIZE 258
 #define XYZ(x, y, z) ((y) * XZ_SIZE * XZ_SIZE + (x) * XZ_SIZE + (z))
 #define XZ(x, z) ((x) * XZ_SIZE + (z))
+#define LAYER_SIZE (XZ_SIZE * XZ_SIZE)
+
+// bit volumes hold one row of XZ_SIZE voxels along z in ROW_WORDS words
+#define ROW_WORDS 2
+#define ROW(x, y) (((y) * XZ_SIZE + (x)) * ROW_WORDS)
+#define BIT_LAYER_SIZE (XZ_SIZE * ROW_WORDS)
+#define BIT(bits, x, y, z) \
+    (((bits)[ROW(x, y) + ((z) >> 6)] >> ((z) & 63)) & 1)
+#define SET_BIT(bits, x, y, z) \
+    ((bits)[ROW(x, y) + ((z) >> 6)] |= (uint64_t)1 << ((z) & 63))
+#define CLEAR_BIT(bits, x, y, z) \
+    ((bits)[ROW(x, y) + ((z) >> 6)] &= ~((uint64_t)1 << ((z) & 63)))
+
+// shading is only sampled from the columns around the chunk's blocks
+#define SHADE_LO (XZ_LO - 1)
+#define SHADE_XZ (XZ_HI - XZ_LO + 3)
+#define SHADE(x, y, z) \
+    (((y) * SHADE_XZ + (x) - SHADE_LO) * SHADE_XZ + (z) - SHADE_LO)
+
+#define GREEDY_BUCKETS (6 * Y_SIZE)
+#define GREEDY_MAX 32
+
+// coarse levels of detail mesh cells of 2 or 4 blocks on a side
+#define LOD_XZ (CHUNK_SIZE / 2)
+#define LOD_CELL(x, y, z) (((y) * LOD_XZ + (x)) * LOD_XZ + (z))
 
-void light_fill(
-    char *opaque, char *light,
-    int x, int y, int z, int w, int force)
+typedef struct {
+    int face;
+    int x;
+    int y;
+    int z;
+    int tile;
+    float ao;
+    float light;
+} GreedyFace;
+
+typedef struct {
+    uint64_t opaque[BIT_LAYER_SIZE * Y_SIZE];
+    uint64_t present[BIT_LAYER_SIZE * Y_SIZE];
+    char light[XZ_SIZE * XZ_SIZE * Y_SIZE];
+    short highest[XZ_SIZE * XZ_SIZE];
+    int greedy_capacity;
+    int greedy_count;
+    GreedyFace *greedy;
+    GreedyFace *greedy_sorted;
+    int greedy_starts[GREEDY_BUCKETS + 1];
+    int greedy_grid[CHUNK_SIZE * (Y_SIZE - 2)];
+    unsigned char shade[SHADE_XZ * SHADE_XZ * Y_SIZE];
+    unsigned char shade_distance[SHADE_XZ * SHADE_XZ];
+    short lod_cells[LOD_XZ * LOD_XZ * (Y_SIZE - 2) / 2];
+} Scratch;
+
+static _Thread_local Scratch *scratch = 0;
+
+int bit_scan(uint64_t bits) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int result = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        result++;
+    }
+    return result;
+#endif
+}
+
+// computes, for the row of voxels at (x, y), which present voxels have
+// each of their six faces exposed; returns the union of all six masks
+uint64_t exposed_faces(
+    uint64_t *opaque, uint64_t *present, int x, int y,
+    uint64_t faces[6][ROW_WORDS])
 {
-    if (x + w < XZ_LO || z + w < XZ_LO) {
-        return;
+    int bottom = y > 1;
+#ifdef __SSE2__
+    __m128i p = _mm_loadu_si128((__m128i *)(present + ROW(x, y)));
+    __m128i o = _mm_loadu_si128((__m128i *)(opaque + ROW(x, y)));
+    __m128i f1 = _mm_andnot_si128(
+        _mm_loadu_si128((__m128i *)(opaque + ROW(x - 1, y))), p);
+    __m128i f2 = _mm_andnot_si128(
+        _mm_loadu_si128((__m128i *)(opaque + ROW(x + 1, y))), p);
+    __m128i f3 = _mm_andnot_si128(
+        _mm_loadu_si128((__m128i *)(opaque + ROW(x, y + 1))), p);
+    __m128i f4 = _mm_andnot_si128(
+        _mm_loadu_si128((__m128i *)(opaque + ROW(x, y - 1))), p);
+    if (!bottom) {
+        f4 = _mm_setzero_si128();
+    }
+    __m128i z1 = _mm_or_si128(
+        _mm_slli_epi64(o, 1), _mm_srli_epi64(_mm_slli_si128(o, 8), 63));
+    __m128i z2 = _mm_or_si128(
+        _mm_srli_epi64(o, 1), _mm_slli_epi64(_mm_srli_si128(o, 8), 63));
+    __m128i f5 = _mm_andnot_si128(z1, p);
+    __m128i f6 = _mm_andnot_si128(z2, p);
+    _mm_storeu_si128((__m128i *)faces[0], f1);
+    _mm_storeu_si128((__m128i *)faces[1], f2);
+    _mm_storeu_si128((__m128i *)faces[2], f3);
+    _mm_storeu_si128((__m128i *)faces[3], f4);
+    _mm_storeu_si128((__m128i *)faces[4], f5);
+    _mm_storeu_si128((__m128i *)faces[5], f6);
+#else
+    uint64_t *o = opaque + ROW(x, y);
+    uint64_t z1[ROW_WORDS] = {o[0] << 1, (o[1] << 1) | (o[0] >> 63)};
+    uint64_t z2[ROW_WORDS] = {(o[0] >> 1) | (o[1] << 63), o[1] >> 1};
+    for (int i = 0; i < ROW_WORDS; i++) {
+        uint64_t p = present[ROW(x, y) + i];
+        faces[0][i] = p & ~opaque[ROW(x - 1, y) + i];
+        faces[1][i] = p & ~opaque[ROW(x + 1, y) + i];
+        faces[2][i] = p & ~opaque[ROW(x, y + 1) + i];
+        faces[3][i] = bottom ? p & ~opaque[ROW(x, y - 1) + i] : 0;
+        faces[4][i] = p & ~z1[i];
+        faces[5][i] = p & ~z2[i];
+    }
+#endif
+    return
+        faces[0][0] | faces[1][0] | faces[2][0] |
+        faces[3][0] | faces[4][0] | faces[5][0] |
+        faces[0][1] | faces[1][1] | faces[2][1] |
+        faces[3][1] | faces[4][1] | faces[5][1];
+}
+
+void greedy_add(
+    Scratch *scratch, int face, int x, int y, int z, int tile,
+    float ao, float light)
+{
+    if (scratch->greedy_count == scratch->greedy_capacity) {
+        int capacity = MAX(scratch->greedy_capacity, 1024) * 2;
+        scratch->greedy = (GreedyFace *)realloc(
+            scratch->greedy, capacity * sizeof(GreedyFace));
+        scratch->greedy_sorted = (GreedyFace *)realloc(
+            scratch->greedy_sorted, capacity * sizeof(GreedyFace));
+        scratch->greedy_capacity = capacity;
+    }
+    GreedyFace *e = scratch->greedy + scratch->greedy_count++;
+    e->face = face;
+    e->x = x;
+    e->y = y;
+    e->z = z;
+    e->tile = tile;
+    e->ao = ao;
+    e->light = light;
+}
+
+int greedy_coord(GreedyFace *e, int axis) {
+    switch (axis) {
+        case 0: return e->x - XZ_LO - 1;
+        case 1: return e->y - 1;
+        default: return e->z - XZ_LO - 1;
     }
-    if (x - w > XZ_HI || z - w > XZ_HI) {
-        return;
+}
+
+int greedy_match(GreedyFace *a, GreedyFace *b) {
+    return a->tile == b->tile && a->ao == b->ao && a->light == b->light;
+}
+
+// merges the collected uniform faces into larger quads, one slice of one
+// face direction at a time, sweeping rows along u and growing along v
+void greedy_mesh(
+    Scratch *scratch, FaceBuffer *buffer, int ox, int oy, int oz)
+{
+    static const int u_axes[6] = {2, 2, 2, 2, 0, 0};
+    static const int v_axes[6] = {1, 1, 0, 0, 1, 1};
+    int count = scratch->greedy_count;
+    int *starts = scratch->greedy_starts;
+    int *grid = scratch->greedy_grid;
+    GreedyFace *faces = scratch->greedy_sorted;
+    memset(starts, 0, sizeof(scratch->greedy_starts));
+    for (int i = 0; i < count; i++) {
+        GreedyFace *e = scratch->greedy + i;
+        int slice = e->face < 2 ? e->x : (e->face < 4 ? e->y : e->z);
+        starts[e->face * Y_SIZE + slice + 1]++;
     }
-    if (y < 0 || y >= Y_SIZE) {
-        return;
+    for (int i = 0; i < GREEDY_BUCKETS; i++) {
+        starts[i + 1] += starts[i];
     }
-    if (light[XYZ(x, y, z)] >= w) {
-        return;
+    for (int i = 0; i < count; i++) {
+        GreedyFace *e = scratch->greedy + i;
+        int slice = e->face < 2 ? e->x : (e->face < 4 ? e->y : e->z);
+        faces[starts[e->face * Y_SIZE + slice]++] = *e;
+    }
+    int start = 0;
+    for (int bucket = 0; bucket < GREEDY_BUCKETS; bucket++) {
+        int end = starts[bucket];
+        if (start == end) {
+            continue;
+        }
+        int face = bucket / Y_SIZE;
+        int u_axis = u_axes[face];
+        int v_axis = v_axes[face];
+        int v_size = v_axis == 1 ? Y_SIZE - 2 : CHUNK_SIZE;
+        for (int i = start; i < end; i++) {
+            GreedyFace *e = faces + i;
+            int u = greedy_coord(e, u_axis);
+            int v = greedy_coord(e, v_axis);
+            grid[u + v * CHUNK_SIZE] = i + 1;
+        }
+        for (int i = start; i < end; i++) {
+            GreedyFace *e = faces + i;
+            int u = greedy_coord(e, u_axis);
+            int v = greedy_coord(e, v_axis);
+            if (grid[u + v * CHUNK_SIZE] != i + 1) {
+                continue;
+            }
+            int width = 1;
+            while (u + width < CHUNK_SIZE && width < GREEDY_MAX) {
+                int other = grid[u + width + v * CHUNK_SIZE];
+                if (!other || !greedy_match(e, faces + other - 1)) {
+                    break;
+                }
+                width++;
+            }
+            int height = 1;
+            while (v + height < v_size && height < GREEDY_MAX) {
+                int row = 1;
+                for (int k = 0; k < width; k++) {
+                    int other = grid[u + k + (v + height) * CHUNK_SIZE];
+                    if (!other || !greedy_match(e, faces + other - 1)) {
+                        row = 0;
+                        break;
+                    }
+                }
+                if (!row) {
+                    break;
+                }
+                height++;
+            }
+            for (int b = 0; b < height; b++) {
+                for (int a = 0; a < width; a++) {
+                    grid[u + a + (v + b) * CHUNK_SIZE] = 0;
+                }
+            }
+            int extent[3] = {1, 1, 1};
+            extent[u_axis] = width;
+            extent[v_axis] = height;
+            float ao[4] = {e->ao, e->ao, e->ao, e->ao};
+            float light[4] = {e->light, e->light, e->light, e->light};
+            make_cube_face(
+                face_buffer_reserve(buffer, 1), ao, light, face, e->tile,
+                e->x + ox, e->y + oy, e->z + oz, 0.5,
+                extent[0], extent[1], extent[2]);
+            buffer->size++;
+        }
+        start = end;
+    }
+    scratch->greedy_count = 0;
+}
+
+// a coarse cell takes the topmost block in it that is not a plant
+int lod_cell(
+    Store *store, uint64_t *present, int x, int y, int z, int n,
+    int ox, int oy, int oz)
+{
+    for (int dy = n - 1; dy >= 0; dy--) {
+        for (int dx = 0; dx < n; dx++) {
+            for (int dz = 0; dz < n; dz++) {
+                if (!BIT(present, x + dx, y + dy, z + dz)) {
+                    continue;
+                }
+                int w = store_get(
+                    store, x + dx + ox, y + dy + oy, z + dz + oz);
+                if (!is_plant(w)) {
+                    return w;
+                }
+            }
+        }
     }
-    if (!force && opaque[XYZ(x, y, z)]) {
-        return;
+    return 0;
+}
+
+// scans the voxels in front of one face of a coarse cell, returning
+// whether any of them is open and the brightest light among them
+int lod_face(
+    Scratch *scratch, int face, int x, int y, int z, int n, int *level)
+{
+    int x0 = x;
+    int y0 = y;
+    int z0 = z;
+    int size[3] = {n, n, n};
+    switch (face) {
+        case 0: x0 = x - 1; break;
+        case 1: x0 = x + n; break;
+        case 2: y0 = y + n; break;
+        case 3: y0 = y - 1; break;
+        case 4: z0 = z - 1; break;
+        case 5: z0 = z + n; break;
+    }
+    size[face / 2] = 1;
+    int open = 0;
+    *level = 0;
+    for (int a = x0; a < x0 + size[0]; a++) {
+        for (int b = y0; b < y0 + size[1]; b++) {
+            for (int c = z0; c < z0 + size[2]; c++) {
+                open |= !BIT(scratch->opaque, a, b, c);
+                *level = MAX(*level, scratch->light[XYZ(a, b, c)]);
+            }
+        }
+    }
+    return open;
+}
+
+// meshes one section of the chunk from its coarse cells. faces between
+// cells of the chunk are culled at the coarse resolution, but faces on the
+// chunk border are kept when any block behind them is open, so that there
+// are no gaps next to chunks drawn at another level of detail.
+void lod_section(
+    Scratch *scratch, FaceBuffer *buffer, int lod, int section,
+    int ox, int oy, int oz, int *miny, int *maxy)
+{
+    short *cells = scratch->lod_cells;
+    int n = 1 << lod;
+    int size = CHUNK_SIZE / n;
+    int top = (Y_SIZE - 2) / n - 1;
+    float ao[4] = {0, 0, 0, 0};
+    int cy0 = section * SECTION_Y / n;
+    for (int cy = cy0; cy < cy0 + SECTION_Y / n; cy++) {
+        for (int cx = 0; cx < size; cx++) {
+            for (int cz = 0; cz < size; cz++) {
+                int w = cells[LOD_CELL(cx, cy, cz)];
+                if (!w) {
+                    continue;
+                }
+                int x = XZ_LO + 1 + cx * n;
+                int y = cy * n - oy;
+                int z = XZ_LO + 1 + cz * n;
+                int inside[6] = {
+                    cx > 0, cx < size - 1, cy < top,
+                    cy > 0, cz > 0, cz < size - 1
+                };
+                int neighbors[6] = {
+                    LOD_CELL(cx - 1, cy, cz), LOD_CELL(cx + 1, cy, cz),
+                    LOD_CELL(cx, cy + 1, cz), LOD_CELL(cx, cy - 1, cz),
+                    LOD_CELL(cx, cy, cz - 1), LOD_CELL(cx, cy, cz + 1)
+                };
+                for (int f = 0; f < 6; f++) {
+                    int level;
+                    int open = lod_face(scratch, f, x, y, z, n, &level);
+                    if (inside[f]) {
+                        open = !cells[neighbors[f]];
+                    }
+                    else if (f == 3) {
+                        open = 0;
+                    }
+                    if (!open) {
+                        continue;
+                    }
+                    float value = level / 15.0;
+                    float light[4] = {value, value, value, value};
+                    make_cube_face(
+                        face_buffer_reserve(buffer, 1), ao, light, f,
+                        blocks[w][f], x + ox, y + oy, z + oz, 0.5, n, n, n);
+                    buffer->size++;
+                    *miny = MIN(*miny, y + oy);
+                    *maxy = MAX(*maxy, y + oy + n - 1);
+                }
+            }
+        }
     }
-    light[XYZ(x, y, z)] = w--;
-    light_fill(opaque, light, x - 1, y, z, w, 0);
-    light_fill(opaque, light, x + 1, y, z, w, 0);
-    light_fill(opaque, light, x, y - 1, z, w, 0);
-    light_fill(opaque, light, x, y + 1, z, w, 0);
-    light_fill(opaque, light, x, y, z - 1, w, 0);
-    light_fill(opaque, light, x, y, z + 1, w, 0);
 }
 
 void compute_chunk(WorkerItem *item) {
-    char *opaque = (char *)calloc(XZ_SIZE * XZ_SIZE * Y_SIZE, sizeof(char));
-    char *light = (char *)calloc(XZ_SIZE * XZ_SIZE * Y_SIZE, sizeof(char));
-    char *highest = (char *)calloc(XZ_SIZE * XZ_SIZE, sizeof(char));
+    // each thread keeps its volumes between jobs and only the layers
+    // that a job touched are cleared again when it is done
+    if (!scratch) {
+        scratch = (Scratch *)calloc(1, sizeof(Scratch));
+    }
+    uint64_t *opaque = scratch->opaque;
+    uint64_t *present = scratch->present;
+    char *light = scratch->light;
+    short *highest = scratch->highest;
+    int opaque_miny = Y_SIZE;
+    int opaque_maxy = -1;
+    int present_miny = Y_SIZE;
+    int present_maxy = -1;
+    int light_miny = Y_SIZE;
+    int light_maxy = -1;
 
     int ox = item->p * CHUNK_SIZE - CHUNK_SIZE - 1;
     int oy = -1;
     int oz = item->q * CHUNK_SIZE - CHUNK_SIZE - 1;
 
-    // check for lights
-    int has_light = 0;
-    if (SHOW_LIGHTS) {
-        for (int a = 0; a < 3; a++) {
-            for (int b = 0; b < 3; b++) {
-                Map *map = item->light_maps[a][b];
-                if (map && map->size) {
-                    has_light = 1;
-                }
-            }
-        }
+    // a section only depends on the sections next to it
+    int first = 0;
+    int last = STORE_SECTIONS - 1;
+    while (first < last && !(item->sections & (1 << first))) {
+        first++;
+    }
+    while (last > first && !(item->sections & (1 << last))) {
+        last--;
     }
+    first = MAX(first - 1, 0);
+    last = MIN(last + 1, STORE_SECTIONS - 1);
 
-    // populate opaque array
+    // populate opaque and present bits
     for (int a = 0; a < 3; a++) {
         for (int b = 0; b < 3; b++) {
-            Map *map = item->block_maps[a][b];
-            if (!map) {
+            Store *store = item->block_stores[a][b];
+            if (!store) {
                 continue;
             }
-            MAP_FOR_EACH(map, ex, ey, ez, ew) {
+            int center = a == 1 && b == 1;
+            for (int i = first; i <= last; i++) {
+                if (store->sections[i]) {
+                    int y = store->dy + i * SECTION_Y - oy;
+                    opaque_miny = MIN(opaque_miny, y);
+                    opaque_maxy = MAX(opaque_maxy, y + SECTION_Y - 1);
+                    if (center) {
+                        present_miny = MIN(present_miny, y);
+                        present_maxy = MAX(present_maxy, y + SECTION_Y - 1);
+                    }
+                }
+            }
+            STORE_FOR_EACH_SECTIONS(store, first, last, ex, ey, ez, ew) {
                 int x = ex - ox;
                 int y = ey - oy;
                 int z = ez - oz;
@@ -997,175 +1829,337 @@ void compute_chunk(WorkerItem *item) {
                     continue;
                 }
                 // END TODO
-                opaque[XYZ(x, y, z)] = !is_transparent(w);
-                if (opaque[XYZ(x, y, z)]) {
+                if (is_transparent(w)) {
+                    CLEAR_BIT(opaque, x, y, z);
+                }
+                else {
+                    SET_BIT(opaque, x, y, z);
+                }
+                if (center && w > 0) {
+                    SET_BIT(present, x, y, z);
+                }
+            } END_STORE_FOR_EACH;
+        }
+    }
+    present_maxy = MIN(present_maxy, Y_SIZE - 2);
+
+    // populate highest array from the chunk heightmaps
+    for (int a = 0; a < 3; a++) {
+        for (int b = 0; b < 3; b++) {
+            Store *store = item->block_stores[a][b];
+            if (!store) {
+                continue;
+            }
+            for (int ex = store->dx; ex < store->dx + SECTION_XZ; ex++) {
+                for (int ez = store->dz; ez < store->dz + SECTION_XZ; ez++) {
+                    int x = ex - ox;
+                    int z = ez - oz;
+                    if (x < 0 || z < 0 || x >= XZ_SIZE || z >= XZ_SIZE) {
+                        continue;
+                    }
+                    int y = store_opaque_height(store, ex, ez) - oy;
                     highest[XZ(x, z)] = MAX(highest[XZ(x, z)], y);
                 }
-            } END_MAP_FOR_EACH;
+            }
         }
     }
 
-    // flood fill light intensities
-    if (has_light) {
-        for (int a = 0; a < 3; a++) {
-            for (int b = 0; b < 3; b++) {
-                Map *map = item->light_maps[a][b];
-                if (!map) {
+    // copy the light levels of the columns the ao of the chunk samples
+    for (int a = 0; a < 3; a++) {
+        for (int b = 0; b < 3; b++) {
+            Volume *volume = item->light_levels[a][b];
+            if (!SHOW_LIGHTS || !volume || !volume->size) {
+                continue;
+            }
+            int x0 = MAX(volume->dx - ox, XZ_LO - 1);
+            int x1 = MIN(volume->dx + CHUNK_SIZE - ox, XZ_HI + 2);
+            int z0 = MAX(volume->dz - oz, XZ_LO - 1);
+            int z1 = MIN(volume->dz + CHUNK_SIZE - oz, XZ_HI + 2);
+            for (int i = first; i <= last; i++) {
+                VolumeSection *section = volume->sections[i];
+                if (!section || x0 >= x1 || z0 >= z1) {
                     continue;
                 }
-                MAP_FOR_EACH(map, ex, ey, ez, ew) {
-                    int x = ex - ox;
-                    int y = ey - oy;
-                    int z = ez - oz;
-                    light_fill(opaque, light, x, y, z, ew, 1);
-                } END_MAP_FOR_EACH;
+                for (int dy = 0; dy < SECTION_Y; dy++) {
+                    int y = volume->dy + i * SECTION_Y + dy - oy;
+                    light_miny = MIN(light_miny, y);
+                    light_maxy = MAX(light_maxy, y);
+                    for (int x = x0; x < x1; x++) {
+                        int lx = x + ox - volume->dx;
+                        int lz = z0 + oz - volume->dz;
+                        memcpy(light + XYZ(x, y, z0), section->data +
+                            (dy * CHUNK_SIZE + lx) * CHUNK_SIZE + lz,
+                            z1 - z0);
+                    }
+                }
             }
         }
     }
 
-    Map *map = item->block_maps[1][1];
+    Store *store = item->block_stores[1][1];
+    uint64_t masks[6][ROW_WORDS];
 
-    // count exposed faces
-    int miny = 256;
-    int maxy = 0;
-    int faces = 0;
-    MAP_FOR_EACH(map, ex, ey, ez, ew) {
-        if (ew <= 0) {
-            continue;
-        }
-        int x = ex - ox;
-        int y = ey - oy;
-        int z = ez - oz;
-        int f1 = !opaque[XYZ(x - 1, y, z)];
-        int f2 = !opaque[XYZ(x + 1, y, z)];
-        int f3 = !opaque[XYZ(x, y + 1, z)];
-        int f4 = !opaque[XYZ(x, y - 1, z)] && (ey > 0);
-        int f5 = !opaque[XYZ(x, y, z - 1)];
-        int f6 = !opaque[XYZ(x, y, z + 1)];
-        int total = f1 + f2 + f3 + f4 + f5 + f6;
-        if (total == 0) {
-            continue;
+    // coarse cells of the meshed sections and the sections next to them
+    if (item->lod) {
+        int n = 1 << item->lod;
+        short *cells = scratch->lod_cells;
+        for (int ey = first * SECTION_Y; ey < (last + 1) * SECTION_Y;
+            ey += n)
+        {
+            int y = ey - oy;
+            int empty = y + n <= present_miny || y > present_maxy;
+            for (int cx = 0; cx < CHUNK_SIZE / n; cx++) {
+                for (int cz = 0; cz < CHUNK_SIZE / n; cz++) {
+                    int x = XZ_LO + 1 + cx * n;
+                    int z = XZ_LO + 1 + cz * n;
+                    cells[LOD_CELL(cx, ey / n, cz)] = empty ? 0 : lod_cell(
+                        store, present, x, y, z, n, ox, oy, oz);
+                }
+            }
         }
-        if (is_plant(ew)) {
-            total = 4;
+    }
+
+    // distance from each voxel up to the nearest opaque voxel at most 8
+    // above it, swept down each column once for all the sections meshed.
+    // nothing above the highest opaque voxel is shaded.
+    static const float shade_curve[9] = {
+        1.0, 0.875, 0.75, 0.625, 0.5, 0.375, 0.25, 0.125, 0.0
+    };
+    unsigned char *shade = scratch->shade;
+    int shade_miny = Y_SIZE;
+    int shade_maxy = -1;
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        int y0 = MAX(present_miny, i * SECTION_Y - oy);
+        int y1 = MIN(present_maxy, (i + 1) * SECTION_Y - 1 - oy);
+        if ((item->sections & (1 << i)) && y0 <= y1 && !item->lod) {
+            shade_miny = MIN(shade_miny, y0 - 1);
+            shade_maxy = MAX(shade_maxy, MIN(y1 + 8, Y_SIZE - 1));
+        }
+    }
+    int shade_top = -1;
+    for (int x = SHADE_LO; x < SHADE_LO + SHADE_XZ; x++) {
+        for (int z = SHADE_LO; z < SHADE_LO + SHADE_XZ; z++) {
+            shade_top = MAX(shade_top, highest[XZ(x, z)]);
+        }
+    }
+    unsigned char *distance = scratch->shade_distance;
+    memset(distance, 8, sizeof(scratch->shade_distance));
+    for (int y = MIN(shade_maxy, shade_top); y >= shade_miny; y--) {
+        for (int x = SHADE_LO; x < SHADE_LO + SHADE_XZ; x++) {
+            uint64_t *o = opaque + ROW(x, y);
+            unsigned char *d = distance + (x - SHADE_LO) * SHADE_XZ;
+            unsigned char *s = shade + SHADE(x, y, SHADE_LO);
+            for (int i = 0; i < SHADE_XZ; i++) {
+                int z = SHADE_LO + i;
+                d[i] = (o[z >> 6] >> (z & 63)) & 1 ? 0 : MIN(d[i] + 1, 8);
+                s[i] = d[i];
+            }
         }
-        miny = MIN(miny, ey);
-        maxy = MAX(maxy, ey);
-        faces += total;
-    } END_MAP_FOR_EACH;
+    }
 
     // generate geometry
-    GLfloat *data = malloc_faces(10, faces);
-    int offset = 0;
-    MAP_FOR_EACH(map, ex, ey, ez, ew) {
-        if (ew <= 0) {
+    FaceBuffer buffer;
+    face_buffer_alloc(&buffer, 10, 4, 4096);
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        Mesh *mesh = item->meshes + i;
+        int start = buffer.size;
+        mesh->faces = 0;
+        if (!(item->sections & (1 << i))) {
             continue;
         }
-        int x = ex - ox;
-        int y = ey - oy;
-        int z = ez - oz;
-        int f1 = !opaque[XYZ(x - 1, y, z)];
-        int f2 = !opaque[XYZ(x + 1, y, z)];
-        int f3 = !opaque[XYZ(x, y + 1, z)];
-        int f4 = !opaque[XYZ(x, y - 1, z)] && (ey > 0);
-        int f5 = !opaque[XYZ(x, y, z - 1)];
-        int f6 = !opaque[XYZ(x, y, z + 1)];
-        int total = f1 + f2 + f3 + f4 + f5 + f6;
-        if (total == 0) {
+        int miny = 256;
+        int maxy = 0;
+        if (item->lod) {
+            lod_section(
+                scratch, &buffer, item->lod, i, ox, oy, oz, &miny, &maxy);
+            mesh->faces = buffer.size - start;
+            mesh->miny = miny;
+            mesh->maxy = maxy;
             continue;
         }
-        char neighbors[27] = {0};
-        char lights[27] = {0};
-        float shades[27] = {0};
-        int index = 0;
-        for (int dx = -1; dx <= 1; dx++) {
-            for (int dy = -1; dy <= 1; dy++) {
-                for (int dz = -1; dz <= 1; dz++) {
-                    neighbors[index] = opaque[XYZ(x + dx, y + dy, z + dz)];
-                    lights[index] = light[XYZ(x + dx, y + dy, z + dz)];
-                    shades[index] = 0;
-                    if (y + dy <= highest[XZ(x + dx, z + dz)]) {
-                        for (int oy = 0; oy < 8; oy++) {
-                            if (opaque[XYZ(x + dx, y + dy + oy, z + dz)]) {
-                                shades[index] = 1.0 - oy * 0.125;
-                                break;
+        int y0 = MAX(present_miny, i * SECTION_Y - oy);
+        int y1 = MIN(present_maxy, (i + 1) * SECTION_Y - 1 - oy);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = XZ_LO; x <= XZ_HI; x++) {
+                if (!exposed_faces(opaque, present, x, y, masks)) {
+                    continue;
+                }
+                for (int w = 0; w < ROW_WORDS; w++) {
+                    uint64_t bits =
+                        masks[0][w] | masks[1][w] | masks[2][w] |
+                        masks[3][w] | masks[4][w] | masks[5][w];
+                    while (bits) {
+                        int z = w * 64 + bit_scan(bits);
+                        bits &= bits - 1;
+                        int ex = x + ox;
+                        int ey = y + oy;
+                        int ez = z + oz;
+                        int ew = store_get(store, ex, ey, ez);
+                        int f1 = (masks[0][w] >> (z & 63)) & 1;
+                        int f2 = (masks[1][w] >> (z & 63)) & 1;
+                        int f3 = (masks[2][w] >> (z & 63)) & 1;
+                        int f4 = (masks[3][w] >> (z & 63)) & 1;
+                        int f5 = (masks[4][w] >> (z & 63)) & 1;
+                        int f6 = (masks[5][w] >> (z & 63)) & 1;
+                        int total = f1 + f2 + f3 + f4 + f5 + f6;
+                        int neighbors = 0;
+                        char lights[27] = {0};
+                        float shades[27] = {0};
+                        int index = 0;
+                        for (int dx = -1; dx <= 1; dx++) {
+                            for (int dy = -1; dy <= 1; dy++) {
+                                for (int dz = -1; dz <= 1; dz++) {
+                                    int bit = BIT(
+                                        opaque, x + dx, y + dy, z + dz);
+                                    neighbors |= bit << index;
+                                    lights[index] = light[
+                                        XYZ(x + dx, y + dy, z + dz)];
+                                    shades[index] = 0;
+                                    if (y + dy <= highest[XZ(x + dx, z + dz)]) {
+                                        shades[index] = shade_curve[shade[
+                                            SHADE(x + dx, y + dy, z + dz)]];
+                                    }
+                                    index++;
+                                }
                             }
                         }
+                        float ao[6][4];
+                        float light[6][4];
+                        occlusion(neighbors, lights, shades, ao, light);
+                        miny = MIN(miny, ey);
+                        maxy = MAX(maxy, ey);
+                        if (is_plant(ew)) {
+                            total = 4;
+                        }
+                        else if (GREEDY_MESHING) {
+                            int *exposed[6] = {&f1, &f2, &f3, &f4, &f5, &f6};
+                            for (int f = 0; f < 6; f++) {
+                                float *a = ao[f];
+                                float *b = light[f];
+                                if (!*exposed[f]) {
+                                    continue;
+                                }
+                                if (a[0] != a[1] || a[0] != a[2] ||
+                                    a[0] != a[3])
+                                {
+                                    continue;
+                                }
+                                if (b[0] != b[1] || b[0] != b[2] ||
+                                    b[0] != b[3])
+                                {
+                                    continue;
+                                }
+                                greedy_add(
+                                    scratch, f, x, y, z, blocks[ew][f],
+                                    a[0], b[0]);
+                                *exposed[f] = 0;
+                                total--;
+                            }
+                            if (!total) {
+                                continue;
+                            }
+                        }
+                        GLfloat *data = face_buffer_reserve(&buffer, total);
+                        if (is_plant(ew)) {
+                            float min_ao = 1;
+                            float max_light = 0;
+                            for (int a = 0; a < 6; a++) {
+                                for (int b = 0; b < 4; b++) {
+                                    min_ao = MIN(min_ao, ao[a][b]);
+                                    max_light = MAX(max_light, light[a][b]);
+                                }
+                            }
+                            float rotation = simplex2(ex, ez, 4, 0.5, 2) * 360;
+                            make_plant(
+                                data, min_ao, max_light,
+                                ex, ey, ez, 0.5, ew, rotation);
+                        }
+                        else {
+                            make_cube(
+                                data, ao, light,
+                                f1, f2, f3, f4, f5, f6,
+                                ex, ey, ez, 0.5, ew);
+                        }
+                        buffer.size += total;
                     }
-                    index++;
-                }
-            }
-        }
-        float ao[6][4];
-        float light[6][4];
-        occlusion(neighbors, lights, shades, ao, light);
-        if (is_plant(ew)) {
-            total = 4;
-            float min_ao = 1;
-            float max_light = 0;
-            for (int a = 0; a < 6; a++) {
-                for (int b = 0; b < 4; b++) {
-                    min_ao = MIN(min_ao, ao[a][b]);
-                    max_light = MAX(max_light, light[a][b]);
                 }
             }
-            float rotation = simplex2(ex, ez, 4, 0.5, 2) * 360;
-            make_plant(
-                data + offset, min_ao, max_light,
-                ex, ey, ez, 0.5, ew, rotation);
         }
-        else {
-            make_cube(
-                data + offset, ao, light,
-                f1, f2, f3, f4, f5, f6,
-                ex, ey, ez, 0.5, ew);
+        if (GREEDY_MESHING) {
+            greedy_mesh(scratch, &buffer, ox, oy, oz);
         }
-        offset += total * 60;
-    } END_MAP_FOR_EACH;
-
-    free(opaque);
-    free(light);
-    free(highest);
-
-    item->miny = miny;
-    item->maxy = maxy;
-    item->faces = faces;
-    item->data = data;
-}
-
-void generate_chunk(Chunk *chunk, WorkerItem *item) {
-    chunk->miny = item->miny;
-    chunk->maxy = item->maxy;
-    chunk->faces = item->faces;
-    del_buffer(chunk->buffer);
-    chunk->buffer = gen_faces(10, item->faces, item->data);
-    gen_sign_buffer(chunk);
-}
+        mesh->faces = buffer.size - start;
+        mesh->miny = miny;
+        mesh->maxy = maxy;
+    }
 
-void gen_chunk_buffer(Chunk *chunk) {
-    WorkerItem _item;
-    WorkerItem *item = &_item;
-    item->p = chunk->p;
-    item->q = chunk->q;
-    for (int dp = -1; dp <= 1; dp++) {
-        for (int dq = -1; dq <= 1; dq++) {
-            Chunk *other = chunk;
-            if (dp || dq) {
-                other = find_chunk(chunk->p + dp, chunk->q + dq);
-            }
-            if (other) {
-                item->block_maps[dp + 1][dq + 1] = &other->map;
-                item->light_maps[dp + 1][dq + 1] = &other->lights;
-            }
-            else {
-                item->block_maps[dp + 1][dq + 1] = 0;
-                item->light_maps[dp + 1][dq + 1] = 0;
-            }
-        }
+    opaque_miny = MAX(opaque_miny, 0);
+    opaque_maxy = MIN(opaque_maxy, Y_SIZE - 1);
+    if (opaque_miny <= opaque_maxy) {
+        memset(opaque + opaque_miny * BIT_LAYER_SIZE, 0,
+            (opaque_maxy - opaque_miny + 1) * BIT_LAYER_SIZE *
+            sizeof(uint64_t));
+    }
+    if (present_miny <= present_maxy) {
+        memset(present + present_miny * BIT_LAYER_SIZE, 0,
+            (present_maxy - present_miny + 1) * BIT_LAYER_SIZE *
+            sizeof(uint64_t));
+    }
+    light_miny = MAX(light_miny, 0);
+    light_maxy = MIN(light_maxy, Y_SIZE - 1);
+    if (light_miny <= light_maxy) {
+        memset(light + light_miny * LAYER_SIZE, 0,
+            (light_maxy - light_miny + 1) * LAYER_SIZE);
+    }
+    memset(highest, 0, sizeof(scratch->highest));
+
+    if (PACKED_VERTICES) {
+        float origin[3];
+        chunk_origin(origin, item->p, item->q);
+        pack_vertices(
+            buffer.data, buffer.size * 4, origin[0], origin[1], origin[2]);
+    }
+
+    item->data = buffer.data;
+}
+
+void record_edit_latency(double edited) {
+    double latency = glfwGetTime() - edited;
+    g->edit_count++;
+    g->edit_latency += latency;
+    g->edit_latency_max = MAX(g->edit_latency_max, latency);
+}
+
+void generate_chunk(Chunk *chunk, WorkerItem *item) {
+    // a packed vertex is the size of two floats
+    int components = PACKED_VERTICES ? 2 : 10;
+    GLfloat *data = item->data;
+    chunk->faces = 0;
+    chunk->miny = 256;
+    chunk->maxy = 0;
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        Mesh *mesh = chunk->meshes + i;
+        if (item->sections & (1 << i)) {
+            Mesh *src = item->meshes + i;
+            int size = sizeof(GLfloat) * 4 * components * src->faces;
+            del_buffer(mesh->buffer);
+            mesh->buffer = src->faces ? gen_buffer(size, data) : 0;
+            mesh->faces = src->faces;
+            mesh->miny = src->miny;
+            mesh->maxy = src->maxy;
+            data += 4 * components * src->faces;
+        }
+        if (mesh->faces) {
+            chunk->faces += mesh->faces;
+            chunk->miny = MIN(chunk->miny, mesh->miny);
+            chunk->maxy = MAX(chunk->maxy, mesh->maxy);
+        }
+    }
+    pool_free(item->data);
+    gen_sign_buffer(chunk);
+    if (item->edited) {
+        record_edit_latency(item->edited);
     }
-    compute_chunk(item);
-    generate_chunk(chunk, item);
-    chunk->dirty = 0;
 }
 
 void map_set_func(int x, int y, int z, int w, void *arg) {
@@ -1176,10 +2170,15 @@ void map_set_func(int x, int y, int z, int w, void *arg) {
 void load_chunk(WorkerItem *item) {
     int p = item->p;
     int q = item->q;
-    Map *block_map = item->block_maps[1][1];
-    Map *light_map = item->light_maps[1][1];
-    create_world(p, q, map_set_func, block_map);
-    db_load_blocks(block_map, p, q);
+    Store *block_store = item->block_stores[1][1];
+    Map *light_map = item->light_map;
+    Map block_map;
+    map_alloc(&block_map,
+        block_store->dx, block_store->dy, block_store->dz, 0x7fff);
+    create_world(p, q, map_set_func, &block_map);
+    db_load_blocks(&block_map, p, q);
+    store_from_map(block_store, &block_map);
+    map_free(&block_map);
     db_load_lights(light_map, p, q);
 }
 
@@ -1191,193 +2190,353 @@ void request_chunk(int p, int q) {
 void init_chunk(Chunk *chunk, int p, int q) {
     chunk->p = p;
     chunk->q = q;
+    index_chunk(chunk);
     chunk->faces = 0;
     chunk->sign_faces = 0;
-    chunk->buffer = 0;
+    memset(chunk->meshes, 0, sizeof(chunk->meshes));
     chunk->sign_buffer = 0;
+    chunk->loaded = 0;
+    chunk->queued = 0;
+    chunk->lod = 0;
+    chunk->dirty = 0;
+    chunk->edited = 0;
     dirty_chunk(chunk);
     SignList *signs = &chunk->signs;
     sign_list_alloc(signs, 16);
     db_load_signs(signs, p, q);
-    Map *block_map = &chunk->map;
+    Store *block_store = &chunk->blocks;
     Map *light_map = &chunk->lights;
     int dx = p * CHUNK_SIZE - 1;
     int dy = 0;
     int dz = q * CHUNK_SIZE - 1;
-    map_alloc(block_map, dx, dy, dz, 0x7fff);
+    store_alloc(block_store, dx, dy, dz);
     map_alloc(light_map, dx, dy, dz, 0xf);
+    volume_alloc(&chunk->light_levels, dx + 1, dy, dz + 1);
 }
 
-void create_chunk(Chunk *chunk, int p, int q) {
-    init_chunk(chunk, p, q);
-
+// loads the blocks of a chunk on the main thread, which is all collisions
+// need; it is meshed by the workers
+void fill_chunk(Chunk *chunk) {
     WorkerItem _item;
     WorkerItem *item = &_item;
     item->p = chunk->p;
     item->q = chunk->q;
-    item->block_maps[1][1] = &chunk->map;
-    item->light_maps[1][1] = &chunk->lights;
+    item->block_stores[1][1] = &chunk->blocks;
+    item->light_map = &chunk->lights;
     load_chunk(item);
+    chunk->loaded = 1;
+    light_chunk(chunk);
 
-    request_chunk(p, q);
+    request_chunk(chunk->p, chunk->q);
 }
 
-void delete_chunks() {
-    int count = g->chunk_count;
+void create_chunk(Chunk *chunk, int p, int q) {
+    init_chunk(chunk, p, q);
+    fill_chunk(chunk);
+}
+
+void del_chunk_buffers(Chunk *chunk) {
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        del_buffer(chunk->meshes[i].buffer);
+    }
+    del_buffer(chunk->sign_buffer);
+}
+
+// whether the chunk is within the delete radius of any player in view
+int chunk_wanted(int p, int q) {
     State *s1 = &g->players->state;
     State *s2 = &(g->players + g->observe1)->state;
     State *s3 = &(g->players + g->observe2)->state;
     State *states[3] = {s1, s2, s3};
+    for (int i = 0; i < 3; i++) {
+        State *s = states[i];
+        int dp = ABS(chunked(s->x) - p);
+        int dq = ABS(chunked(s->z) - q);
+        if (MAX(dp, dq) < g->delete_radius) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void delete_chunks() {
+    int count = g->chunk_count;
     for (int i = 0; i < count; i++) {
         Chunk *chunk = g->chunks + i;
-        int delete = 1;
-        for (int j = 0; j < 3; j++) {
-            State *s = states[j];
-            int p = chunked(s->x);
-            int q = chunked(s->z);
-            if (chunk_distance(chunk, p, q) < g->delete_radius) {
-                delete = 0;
-                break;
-            }
-        }
+        int delete = !chunk->queued && !chunk_wanted(chunk->p, chunk->q);
         if (delete) {
-            map_free(&chunk->map);
+            light_unload(chunk);
+            store_free(&chunk->blocks);
             map_free(&chunk->lights);
+            volume_free(&chunk->light_levels);
             sign_list_free(&chunk->signs);
-            del_buffer(chunk->buffer);
-            del_buffer(chunk->sign_buffer);
+            del_chunk_buffers(chunk);
+            unindex_chunk(chunk);
             Chunk *other = g->chunks + (--count);
-            memcpy(chunk, other, sizeof(Chunk));
+            if (other != chunk) {
+                memcpy(chunk, other, sizeof(Chunk));
+                index_chunk(chunk);
+            }
         }
     }
     g->chunk_count = count;
+    // the light of all deleted chunks goes at once, so none of it is
+    // filled back in from a chunk that is deleted too
+    light_darken(0);
+    light_fill(0);
 }
 
 void delete_all_chunks() {
     for (int i = 0; i < g->chunk_count; i++) {
         Chunk *chunk = g->chunks + i;
-        map_free(&chunk->map);
+        store_free(&chunk->blocks);
         map_free(&chunk->lights);
+        volume_free(&chunk->light_levels);
         sign_list_free(&chunk->signs);
-        del_buffer(chunk->buffer);
-        del_buffer(chunk->sign_buffer);
+        del_chunk_buffers(chunk);
     }
     g->chunk_count = 0;
+    memset(g->chunk_index, 0, sizeof(g->chunk_index));
+    g->epoch++;
+    // the jobs still out are for the old world
+    JobQueue *jobs = &g->jobs;
+    mtx_lock(&jobs->mtx);
+    for (int i = 0; i < jobs->capacity; i++) {
+        WorkerItem *item = jobs->items + i;
+        if (item->busy) {
+            item->cancelled = 1;
+            item->score = -1;
+        }
+    }
+    mtx_unlock(&jobs->mtx);
+}
+
+// hands the sections of a job that was not uploaded back to its chunk to
+// be queued again
+void requeue_chunk(Chunk *chunk, WorkerItem *item) {
+    chunk->queued = 0;
+    dirty_sections(chunk, item->sections, 0);
+    if (!chunk->edited) {
+        chunk->edited = item->edited;
+    }
+}
+
+void free_job(WorkerItem *item) {
+    JobQueue *jobs = &g->jobs;
+    item->busy = 0;
+    jobs->free[jobs->free_count++] = item;
 }
 
 void check_workers() {
-    for (int i = 0; i < WORKERS; i++) {
-        Worker *worker = g->workers + i;
-        mtx_lock(&worker->mtx);
-        if (worker->state == WORKER_DONE) {
-            WorkerItem *item = &worker->item;
-            Chunk *chunk = find_chunk(item->p, item->q);
-            if (chunk) {
-                if (item->load) {
-                    Map *block_map = item->block_maps[1][1];
-                    Map *light_map = item->light_maps[1][1];
-                    map_free(&chunk->map);
-                    map_free(&chunk->lights);
-                    map_copy(&chunk->map, block_map);
-                    map_copy(&chunk->lights, light_map);
-                    request_chunk(item->p, item->q);
+    JobQueue *jobs = &g->jobs;
+    WorkerItem *done[MAX_JOBS];
+    mtx_lock(&jobs->mtx);
+    int count = jobs->done_count;
+    memcpy(done, jobs->done, sizeof(WorkerItem *) * count);
+    jobs->done_count = 0;
+    mtx_unlock(&jobs->mtx);
+    for (int i = 0; i < count; i++) {
+        WorkerItem *item = done[i];
+        // results of jobs queued before all chunks were deleted are for
+        // another world
+        Chunk *chunk = 0;
+        if (item->epoch == g->epoch) {
+            chunk = find_chunk(item->p, item->q);
+        }
+        // the blocks of a chunk the main thread had to load itself while
+        // the job was running are kept
+        int loaded = chunk && item->loaded && !chunk->loaded;
+        if (loaded) {
+            Store *block_store = item->block_stores[1][1];
+            store_free(&chunk->blocks);
+            map_free(&chunk->lights);
+            store_move(&chunk->blocks, block_store);
+            map_move(&chunk->lights, item->light_map);
+            chunk->loaded = 1;
+            request_chunk(item->p, item->q);
+            light_chunk(chunk);
+        }
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < 3; b++) {
+                Store *block_store = item->block_stores[a][b];
+                Volume *light_levels = item->light_levels[a][b];
+                if (block_store) {
+                    store_free(block_store);
+                    free(block_store);
                 }
-                generate_chunk(chunk, item);
-            }
-            for (int a = 0; a < 3; a++) {
-                for (int b = 0; b < 3; b++) {
-                    Map *block_map = item->block_maps[a][b];
-                    Map *light_map = item->light_maps[a][b];
-                    if (block_map) {
-                        map_free(block_map);
-                        free(block_map);
-                    }
-                    if (light_map) {
-                        map_free(light_map);
-                        free(light_map);
-                    }
+                if (light_levels) {
+                    volume_free(light_levels);
+                    free(light_levels);
                 }
             }
-            worker->state = WORKER_IDLE;
         }
-        mtx_unlock(&worker->mtx);
+        if (item->light_map) {
+            map_free(item->light_map);
+            free(item->light_map);
+        }
+        if (chunk && item->meshed) {
+            // the chunk stays queued until upload_chunks gets to it
+            jobs->ready[jobs->ready_count++] = item;
+            continue;
+        }
+        if (chunk) {
+            // a cancelled or load only job leaves its work to be queued
+            // again
+            requeue_chunk(chunk, item);
+        }
+        else if (item->meshed) {
+            pool_free(item->data);
+        }
+        free_job(item);
     }
 }
 
-void force_chunks(Player *player) {
-    State *s = &player->state;
-    int p = chunked(s->x);
-    int q = chunked(s->z);
-    int r = 1;
-    for (int dp = -r; dp <= r; dp++) {
-        for (int dq = -r; dq <= r; dq++) {
-            int a = p + dp;
-            int b = q + dq;
-            Chunk *chunk = find_chunk(a, b);
+int mesh_size(WorkerItem *item) {
+    int components = PACKED_VERTICES ? 2 : 10;
+    int faces = 0;
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        if (item->sections & (1 << i)) {
+            faces += item->meshes[i].faces;
+        }
+    }
+    return sizeof(GLfloat) * 4 * components * faces;
+}
+
+// uploads finished meshes, edited and visible chunks nearest the player
+// first. once UPLOAD_BYTES or UPLOAD_TIME is used up the rest waits for
+// the next frame, so that many jobs finishing together do not stall one
+// frame. at least one mesh goes up every frame.
+void upload_chunks(float planes[6][4], int p, int q) {
+    JobQueue *jobs = &g->jobs;
+    if (!jobs->ready_count) {
+        return;
+    }
+    int count = 0;
+    for (int i = 0; i < jobs->ready_count; i++) {
+        WorkerItem *item = jobs->ready[i];
+        Chunk *chunk = 0;
+        if (item->epoch == g->epoch) {
+            chunk = find_chunk(item->p, item->q);
+        }
+        // a mesh that waited while its sections were edited again is
+        // stale, the chunk is meshed again instead
+        if (!chunk || item->cancelled || (chunk->dirty & item->sections)) {
+            pool_free(item->data);
             if (chunk) {
-                if (chunk->dirty) {
-                    gen_chunk_buffer(chunk);
-                }
+                requeue_chunk(chunk, item);
             }
-            else if (g->chunk_count < MAX_CHUNKS) {
-                chunk = g->chunks + g->chunk_count++;
-                create_chunk(chunk, a, b);
-                gen_chunk_buffer(chunk);
+            free_job(item);
+            continue;
+        }
+        // the chunk cannot be queued again for an edit made while its mesh
+        // waits, so that mesh goes first
+        int edited = item->edited || chunk->edited;
+        int distance = MAX(ABS(item->p - p), ABS(item->q - q));
+        int invisible = distance > 1 &&
+            !chunk_visible(planes, item->p, item->q, 0, 256);
+        item->score = (!edited << 25) | (invisible << 24) | distance;
+        jobs->ready[count++] = item;
+    }
+    jobs->ready_count = count;
+    double start = glfwGetTime();
+    int bytes = 0;
+    int uploaded = 0;
+    while (jobs->ready_count) {
+        int best = 0;
+        for (int i = 1; i < jobs->ready_count; i++) {
+            if (jobs->ready[i]->score < jobs->ready[best]->score) {
+                best = i;
             }
         }
+        WorkerItem *item = jobs->ready[best];
+        int size = mesh_size(item);
+        if (uploaded && (bytes + size > UPLOAD_BYTES ||
+            glfwGetTime() - start > UPLOAD_TIME))
+        {
+            break;
+        }
+        jobs->ready[best] = jobs->ready[--jobs->ready_count];
+        Chunk *chunk = find_chunk(item->p, item->q);
+        chunk->queued = 0;
+        generate_chunk(chunk, item);
+        free_job(item);
+        bytes += size;
+        uploaded++;
+    }
+    for (int i = 0; i < jobs->ready_count; i++) {
+        WorkerItem *item = jobs->ready[i];
+        if (!item->deferred) {
+            item->deferred = 1;
+            g->upload_deferred++;
+        }
+    }
+}
+
+// waits a little for the job loading a chunk to come back
+void wait_chunk(int p, int q) {
+    JobQueue *jobs = &g->jobs;
+    struct timespec pause = {0, 1000000};
+    double deadline = glfwGetTime() + FORCE_CHUNK_TIMEOUT;
+    Chunk *chunk = find_chunk(p, q);
+    while (chunk && chunk->queued && !chunk->loaded &&
+        glfwGetTime() < deadline)
+    {
+        mtx_lock(&jobs->mtx);
+        int done_count = jobs->done_count;
+        mtx_unlock(&jobs->mtx);
+        if (done_count) {
+            check_workers();
+            chunk = find_chunk(p, q);
+        }
+        else {
+            thrd_sleep(&pause, NULL);
+        }
+    }
+}
+
+// waits until no worker is running a job, so that none of them is still
+// reading the database when it is closed
+void wait_jobs() {
+    JobQueue *jobs = &g->jobs;
+    struct timespec pause = {0, 1000000};
+    check_workers();
+    while (jobs->free_count + jobs->ready_count < jobs->capacity) {
+        thrd_sleep(&pause, NULL);
+        check_workers();
     }
 }
 
-void ensure_chunks_worker(Player *player, Worker *worker) {
+// makes sure the blocks under the local player are there for collisions.
+// the chunks around the player are loaded and meshed by the workers ahead
+// of the others; only if the player's own chunk is not in yet does this
+// wait a little for its job, and then load its blocks right away. the
+// chunks of observed players only come through the queue.
+void force_chunks(Player *player) {
     State *s = &player->state;
-    float matrix[16];
-    set_matrix_3d(
-        matrix, g->width, g->height,
-        s->x, s->y, s->z, s->rx, s->ry, g->fov, g->ortho, g->render_radius);
-    float planes[6][4];
-    frustum_planes(planes, g->render_radius, matrix);
     int p = chunked(s->x);
     int q = chunked(s->z);
-    int r = g->create_radius;
-    int start = 0x0fffffff;
-    int best_score = start;
-    int best_a = 0;
-    int best_b = 0;
-    for (int dp = -r; dp <= r; dp++) {
-        for (int dq = -r; dq <= r; dq++) {
-            int a = p + dp;
-            int b = q + dq;
-            int index = (ABS(a) ^ ABS(b)) % WORKERS;
-            if (index != worker->index) {
-                continue;
-            }
-            Chunk *chunk = find_chunk(a, b);
-            if (chunk && !chunk->dirty) {
-                continue;
-            }
-            int distance = MAX(ABS(dp), ABS(dq));
-            int invisible = !chunk_visible(planes, a, b, 0, 256);
-            int priority = 0;
-            if (chunk) {
-                priority = chunk->buffer && chunk->dirty;
-            }
-            int score = (invisible << 24) | (priority << 16) | distance;
-            if (score < best_score) {
-                best_score = score;
-                best_a = a;
-                best_b = b;
-            }
+    Chunk *chunk = find_chunk(p, q);
+    if (chunk && !chunk->loaded && chunk->queued) {
+        wait_chunk(p, q);
+        chunk = find_chunk(p, q);
+    }
+    if (chunk) {
+        if (!chunk->loaded) {
+            fill_chunk(chunk);
         }
     }
-    if (best_score == start) {
-        return;
+    else if (g->chunk_count < MAX_CHUNKS) {
+        chunk = g->chunks + g->chunk_count++;
+        create_chunk(chunk, p, q);
     }
-    int a = best_a;
-    int b = best_b;
-    int load = 0;
+}
+
+void queue_chunk(JobCandidate *candidate) {
+    JobQueue *jobs = &g->jobs;
+    int a = candidate->p;
+    int b = candidate->q;
     Chunk *chunk = find_chunk(a, b);
     if (!chunk) {
-        load = 1;
         if (g->chunk_count < MAX_CHUNKS) {
             chunk = g->chunks + g->chunk_count++;
             init_chunk(chunk, a, b);
@@ -1386,10 +2545,30 @@ void ensure_chunks_worker(Player *player, Worker *worker) {
             return;
         }
     }
-    WorkerItem *item = &worker->item;
+    int load = !chunk->loaded;
+    WorkerItem *item = jobs->free[--jobs->free_count];
     item->p = chunk->p;
     item->q = chunk->q;
+    item->epoch = g->epoch;
+    item->score = candidate->score;
+    item->busy = 1;
+    item->cancelled = 0;
+    item->prefetch = candidate->score >= PREFETCH_SCORE;
     item->load = load;
+    item->loaded = 0;
+    item->meshed = 0;
+    item->deferred = 0;
+    item->lod = candidate->lod;
+    item->sections = chunk->dirty;
+    if (load || candidate->lod != chunk->lod) {
+        item->sections = ALL_SECTIONS;
+    }
+    item->edited = chunk->edited;
+    item->light_map = 0;
+    if (load) {
+        item->light_map = malloc(sizeof(Map));
+        map_copy(item->light_map, &chunk->lights);
+    }
     for (int dp = -1; dp <= 1; dp++) {
         for (int dq = -1; dq <= 1; dq++) {
             Chunk *other = chunk;
@@ -1397,54 +2576,295 @@ void ensure_chunks_worker(Player *player, Worker *worker) {
                 other = find_chunk(chunk->p + dp, chunk->q + dq);
             }
             if (other) {
-                Map *block_map = malloc(sizeof(Map));
-                map_copy(block_map, &other->map);
-                Map *light_map = malloc(sizeof(Map));
-                map_copy(light_map, &other->lights);
-                item->block_maps[dp + 1][dq + 1] = block_map;
-                item->light_maps[dp + 1][dq + 1] = light_map;
+                // neighbors are shared copy-on-write snapshots; a load job
+                // writes into its own chunk so it gets private copies.
+                // reference counts are only touched on the main thread.
+                Store *block_store = malloc(sizeof(Store));
+                Volume *light_levels = malloc(sizeof(Volume));
+                if (load && other == chunk) {
+                    store_copy(block_store, &other->blocks);
+                }
+                else {
+                    store_share(block_store, &other->blocks);
+                }
+                volume_share(light_levels, &other->light_levels);
+                item->block_stores[dp + 1][dq + 1] = block_store;
+                item->light_levels[dp + 1][dq + 1] = light_levels;
             }
             else {
-                item->block_maps[dp + 1][dq + 1] = 0;
-                item->light_maps[dp + 1][dq + 1] = 0;
+                item->block_stores[dp + 1][dq + 1] = 0;
+                item->light_levels[dp + 1][dq + 1] = 0;
             }
         }
     }
+    chunk->lod = candidate->lod;
+    chunk->queued = 1;
     chunk->dirty = 0;
-    worker->state = WORKER_BUSY;
-    cnd_signal(&worker->cnd);
+    chunk->edited = 0;
+    mtx_lock(&jobs->mtx);
+    jobs->pending[jobs->pending_count++] = item;
+    cnd_signal(&jobs->cnd);
+    mtx_unlock(&jobs->mtx);
 }
 
-void ensure_chunks(Player *player) {
+// cancels the jobs of chunks that are about to be deleted. workers check
+// for cancellation before loading and before meshing, and take cancelled
+// jobs first to hand them straight back.
+void cancel_jobs() {
+    JobQueue *jobs = &g->jobs;
+    mtx_lock(&jobs->mtx);
+    for (int i = 0; i < jobs->capacity; i++) {
+        WorkerItem *item = jobs->items + i;
+        if (item->busy && !chunk_wanted(item->p, item->q)) {
+            item->cancelled = 1;
+            item->score = -1;
+        }
+    }
+    mtx_unlock(&jobs->mtx);
+}
+
+// rescores the queued jobs from where the player is now
+void update_jobs(float planes[6][4], int p, int q) {
+    JobQueue *jobs = &g->jobs;
+    mtx_lock(&jobs->mtx);
+    for (int i = 0; i < jobs->pending_count; i++) {
+        WorkerItem *item = jobs->pending[i];
+        if (item->cancelled || item->prefetch) {
+            continue;
+        }
+        int distance = MAX(ABS(item->p - p), ABS(item->q - q));
+        int invisible = distance > 1 &&
+            !chunk_visible(planes, item->p, item->q, 0, 256);
+        item->score &= ~((1 << 24) | 0xffff);
+        item->score |= (invisible << 24) | distance;
+    }
+    mtx_unlock(&jobs->mtx);
+}
+
+int job_cancelled(WorkerItem *item) {
+    JobQueue *jobs = &g->jobs;
+    mtx_lock(&jobs->mtx);
+    int result = item->cancelled;
+    mtx_unlock(&jobs->mtx);
+    return result;
+}
+
+// keeps the best candidates sorted by score, at most slots of them
+void add_candidate(
+    JobCandidate *best, int *count, int slots, int score, int p, int q,
+    int lod)
+{
+    if (*count == slots && score >= best[*count - 1].score) {
+        return;
+    }
+    int i = *count < slots ? (*count)++ : *count - 1;
+    while (i > 0 && best[i - 1].score > score) {
+        best[i] = best[i - 1];
+        i--;
+    }
+    best[i].score = score;
+    best[i].p = p;
+    best[i].q = q;
+    best[i].lod = lod;
+}
+
+// loads the chunks that will come into range where the player is heading,
+// PREFETCH_TIME seconds ahead at the current velocity, or those the player
+// looks towards when standing still. they rank behind all the work in
+// range, the nearest first and those the player is looking towards before
+// those behind. chunks are only prefetched within the delete radius so
+// that they are not cancelled again right away.
+void prefetch_chunks(
+    Player *player, JobCandidate *best, int *count, int slots)
+{
+    State *s = &player->state;
+    float *v = g->velocity;
+    if (*count >= slots) {
+        return;
+    }
+    float vx, vy, vz;
+    get_sight_vector(s->rx, s->ry, &vx, &vy, &vz);
+    int r = g->create_radius;
+    float tx = s->x + v[0] * PREFETCH_TIME;
+    float tz = s->z + v[2] * PREFETCH_TIME;
+    if (!v[0] && !v[2]) {
+        // the chunks along the view just past the create radius
+        float d = sqrtf(vx * vx + vz * vz);
+        if (d < 0.1) {
+            return;
+        }
+        tx = s->x + vx / d * r * CHUNK_SIZE;
+        tz = s->z + vz / d * r * CHUNK_SIZE;
+    }
+    int p = chunked(s->x);
+    int q = chunked(s->z);
+    int pp = chunked(tx);
+    int pq = chunked(tz);
+    for (int dp = -r; dp <= r; dp++) {
+        for (int dq = -r; dq <= r; dq++) {
+            int a = pp + dp;
+            int b = pq + dq;
+            int distance = MAX(ABS(a - p), ABS(b - q));
+            if (distance <= r || distance >= g->delete_radius) {
+                continue;
+            }
+            Chunk *chunk = find_chunk(a, b);
+            if (chunk && (chunk->loaded || chunk->queued)) {
+                continue;
+            }
+            int behind = (a - p) * vx + (b - q) * vz < 0;
+            int score = PREFETCH_SCORE | (behind << 24) | (distance << 8) |
+                MAX(ABS(dp), ABS(dq));
+            int lod = chunk_lod(LOD_LEVELS - 1, distance);
+            add_candidate(best, count, slots, score, a, b, lod);
+        }
+    }
+}
+
+// scores every chunk in range that needs work and queues the best ones,
+// as many as there are free job slots. a chunk with a job in flight waits
+// for it to finish so that its results arrive in order.
+void queue_chunks(Player *player) {
+    JobQueue *jobs = &g->jobs;
+    State *s = &player->state;
+    float matrix[16];
+    set_matrix_3d(
+        matrix, g->width, g->height,
+        s->x, s->y, s->z, s->rx, s->ry, g->fov, g->ortho, g->render_radius);
+    float planes[6][4];
+    frustum_planes(planes, g->render_radius, matrix);
+    int p = chunked(s->x);
+    int q = chunked(s->z);
+    int slots = jobs->free_count;
+    if (!slots) {
+        return;
+    }
+    int r = g->create_radius;
+    JobCandidate best[MAX_JOBS];
+    int count = 0;
+    for (int dp = -r; dp <= r; dp++) {
+        for (int dq = -r; dq <= r; dq++) {
+            int a = p + dp;
+            int b = q + dq;
+            Chunk *chunk = find_chunk(a, b);
+            int distance = MAX(ABS(dp), ABS(dq));
+            int lod = chunk_lod(
+                chunk ? chunk->lod : LOD_LEVELS - 1, distance);
+            if (chunk && (chunk->queued || (chunk->loaded &&
+                !chunk->dirty && lod == chunk->lod)))
+            {
+                continue;
+            }
+            // the chunks around the player go first even when out of
+            // view, they are what the player walks into
+            int invisible = distance > 1 &&
+                !chunk_visible(planes, a, b, 0, 256);
+            int priority = 0;
+            int edited = 0;
+            if (chunk) {
+                priority = chunk->faces && chunk->dirty;
+                edited = chunk->edited != 0;
+                // refining a mesh is as urgent as a missing one, making
+                // it coarser only saves memory
+                if (chunk->faces && lod != chunk->lod) {
+                    priority = lod < chunk->lod ? 0 : 2;
+                }
+            }
+            int score = (!edited << 25) | (invisible << 24) |
+                (priority << 16) | distance;
+            add_candidate(best, &count, slots, score, a, b, lod);
+        }
+    }
+    if (count < slots && player == g->players) {
+        int prefetching = 0;
+        for (int i = 0; i < jobs->capacity; i++) {
+            WorkerItem *item = jobs->items + i;
+            prefetching += item->busy && item->prefetch;
+        }
+        int moving = g->velocity[0] || g->velocity[2];
+        int budget = moving ? PREFETCH_JOBS : PREFETCH_LOOK_JOBS;
+        slots = MIN(slots, count + budget - prefetching);
+        prefetch_chunks(player, best, &count, slots);
+    }
+    for (int i = 0; i < count; i++) {
+        queue_chunk(best + i);
+    }
+}
+
+// the work on finished and queued jobs that is done once per frame, from
+// where the local player is
+void update_chunks(Player *player) {
+    State *s = &player->state;
+    float matrix[16];
+    set_matrix_3d(
+        matrix, g->width, g->height,
+        s->x, s->y, s->z, s->rx, s->ry, g->fov, g->ortho, g->render_radius);
+    float planes[6][4];
+    frustum_planes(planes, g->render_radius, matrix);
+    int p = chunked(s->x);
+    int q = chunked(s->z);
     check_workers();
+    cancel_jobs();
     force_chunks(player);
-    for (int i = 0; i < WORKERS; i++) {
-        Worker *worker = g->workers + i;
-        mtx_lock(&worker->mtx);
-        if (worker->state == WORKER_IDLE) {
-            ensure_chunks_worker(player, worker);
+    upload_chunks(planes, p, q);
+    update_jobs(planes, p, q);
+}
+
+// whether a chunk that was just loaded gets light once the main thread
+// lights it: its own sources or light in a neighbor that can reach in
+int job_lit(WorkerItem *item) {
+    if (!SHOW_LIGHTS) {
+        return 0;
+    }
+    Map *map = item->light_map;
+    for (unsigned int i = 0; i <= map->mask; i++) {
+        MapEntry *entry = &map->data[i].entry;
+        if (!EMPTY_ENTRY(entry) && entry->e.w > 0) {
+            return 1;
+        }
+    }
+    for (int a = 0; a < 3; a++) {
+        for (int b = 0; b < 3; b++) {
+            Volume *light_levels = item->light_levels[a][b];
+            if (light_levels && light_levels->size) {
+                return 1;
+            }
         }
-        mtx_unlock(&worker->mtx);
     }
+    return 0;
 }
 
 int worker_run(void *arg) {
-    Worker *worker = (Worker *)arg;
+    JobQueue *jobs = (JobQueue *)arg;
     int running = 1;
     while (running) {
-        mtx_lock(&worker->mtx);
-        while (worker->state != WORKER_BUSY) {
-            cnd_wait(&worker->cnd, &worker->mtx);
+        mtx_lock(&jobs->mtx);
+        while (!jobs->pending_count) {
+            cnd_wait(&jobs->cnd, &jobs->mtx);
         }
-        mtx_unlock(&worker->mtx);
-        WorkerItem *item = &worker->item;
-        if (item->load) {
+        int index = 0;
+        for (int i = 1; i < jobs->pending_count; i++) {
+            if (jobs->pending[i]->score < jobs->pending[index]->score) {
+                index = i;
+            }
+        }
+        WorkerItem *item = jobs->pending[index];
+        jobs->pending[index] = jobs->pending[--jobs->pending_count];
+        mtx_unlock(&jobs->mtx);
+        if (item->load && !job_cancelled(item)) {
             load_chunk(item);
+            item->loaded = 1;
+        }
+        // a chunk that is lit after it loads would be meshed again right
+        // away, so it is only loaded and queued for its mesh once lit
+        int lit = item->loaded && job_lit(item);
+        if (!lit && !job_cancelled(item)) {
+            compute_chunk(item);
+            item->meshed = 1;
         }
-        compute_chunk(item);
-        mtx_lock(&worker->mtx);
-        worker->state = WORKER_DONE;
-        mtx_unlock(&worker->mtx);
+        mtx_lock(&jobs->mtx);
+        jobs->done[jobs->done_count++] = item;
+        mtx_unlock(&jobs->mtx);
     }
     return 0;
 }
@@ -1456,7 +2876,7 @@ void unset_sign(int x, int y, int z) {
     if (chunk) {
         SignList *signs = &chunk->signs;
         if (sign_list_remove_all(signs, x, y, z)) {
-            chunk->dirty = 1;
+            chunk->dirty |= section_mask(y, y);
             db_delete_signs(x, y, z);
         }
     }
@@ -1472,7 +2892,7 @@ void unset_sign_face(int x, int y, int z, int face) {
     if (chunk) {
         SignList *signs = &chunk->signs;
         if (sign_list_remove(signs, x, y, z, face)) {
-            chunk->dirty = 1;
+            chunk->dirty |= section_mask(y, y);
             db_delete_sign(x, y, z, face);
         }
     }
@@ -1493,7 +2913,7 @@ void _set_sign(
         SignList *signs = &chunk->signs;
         sign_list_add(signs, x, y, z, face, text);
         if (dirty) {
-            chunk->dirty = 1;
+            chunk->dirty |= section_mask(y, y);
         }
     }
     db_insert_sign(p, q, x, y, z, face, text);
@@ -1506,6 +2926,24 @@ void set_sign(int x, int y, int z, int face, const char *text) {
     client_sign(x, y, z, face, text);
 }
 
+int _set_light(Chunk *chunk, int x, int y, int z, int w) {
+    Map *map = &chunk->lights;
+    int previous = map_get(map, x, y, z);
+    if (previous == w) {
+        return 0;
+    }
+    map_set(map, x, y, z, w);
+    if (SHOW_LIGHTS) {
+        if (w > previous) {
+            light_add(x, y, z, w, 1);
+        }
+        else {
+            light_remove(x, y, z, 1);
+        }
+    }
+    return 1;
+}
+
 void toggle_light(int x, int y, int z) {
     int p = chunked(x);
     int q = chunked(z);
@@ -1513,19 +2951,16 @@ void toggle_light(int x, int y, int z) {
     if (chunk) {
         Map *map = &chunk->lights;
         int w = map_get(map, x, y, z) ? 0 : 15;
-        map_set(map, x, y, z, w);
+        _set_light(chunk, x, y, z, w);
         db_insert_light(p, q, x, y, z, w);
         client_light(x, y, z, w);
-        dirty_chunk(chunk);
     }
 }
 
 void set_light(int p, int q, int x, int y, int z, int w) {
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
-        Map *map = &chunk->lights;
-        if (map_set(map, x, y, z, w)) {
-            dirty_chunk(chunk);
+        if (_set_light(chunk, x, y, z, w)) {
             db_insert_light(p, q, x, y, z, w);
         }
     }
@@ -1537,10 +2972,21 @@ void set_light(int p, int q, int x, int y, int z, int w) {
 void _set_block(int p, int q, int x, int y, int z, int w, int dirty) {
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
-        Map *map = &chunk->map;
-        if (map_set(map, x, y, z, w)) {
+        Store *store = &chunk->blocks;
+        int opaque = !is_transparent(store_get(store, x, y, z));
+        if (store_set(store, x, y, z, w)) {
             if (dirty) {
-                dirty_chunk(chunk);
+                dirty_block(chunk, y);
+            }
+            if (SHOW_LIGHTS && opaque == is_transparent(w) &&
+                chunked(x) == p && chunked(z) == q)
+            {
+                if (opaque) {
+                    light_open(x, y, z, dirty);
+                }
+                else {
+                    light_remove(x, y, z, dirty);
+                }
             }
             db_insert_block(p, q, x, y, z, w);
         }
@@ -1588,8 +3034,8 @@ int get_block(int x, int y, int z) {
     int q = chunked(z);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
-        Map *map = &chunk->map;
-        return map_get(map, x, y, z);
+        Store *store = &chunk->blocks;
+        return store_get(store, x, y, z);
     }
     return 0;
 }
@@ -1609,7 +3055,7 @@ void builder_block(int x, int y, int z, int w) {
 int render_chunks(Attrib *attrib, Player *player) {
     int result = 0;
     State *s = &player->state;
-    ensure_chunks(player);
+    queue_chunks(player);
     int p = chunked(s->x);
     int q = chunked(s->z);
     float light = get_daylight();
@@ -1628,19 +3074,27 @@ int render_chunks(Attrib *attrib, Player *player) {
     glUniform1f(attrib->extra3, g->render_radius * CHUNK_SIZE);
     glUniform1i(attrib->extra4, g->ortho);
     glUniform1f(attrib->timer, time_of_day());
+    glUniform1i(attrib->extra5, PACKED_VERTICES);
     for (int i = 0; i < g->chunk_count; i++) {
         Chunk *chunk = g->chunks + i;
         if (chunk_distance(chunk, p, q) > g->render_radius) {
             continue;
         }
-        if (!chunk_visible(
-            planes, chunk->p, chunk->q, chunk->miny, chunk->maxy))
-        {
-            continue;
+        for (int j = 0; j < STORE_SECTIONS; j++) {
+            Mesh *mesh = chunk->meshes + j;
+            if (!mesh->faces) {
+                continue;
+            }
+            if (!chunk_visible(
+                planes, chunk->p, chunk->q, mesh->miny, mesh->maxy))
+            {
+                continue;
+            }
+            draw_mesh(attrib, chunk, mesh);
+            result += mesh->faces;
         }
-        draw_chunk(attrib, chunk);
-        result += chunk->faces;
     }
+    glUniform1i(attrib->extra5, 0);
     return result;
 }
 
@@ -2063,14 +3517,33 @@ void parse_command(const char *buffer, int forward) {
         snprintf(g->db_path, MAX_PATH_LENGTH, "%s", DB_PATH);
     }
     else if (sscanf(buffer, "/view %d", &radius) == 1) {
-        if (radius >= 1 && radius <= 24) {
+        if (radius >= 1 && radius <= 40) {
             g->create_radius = radius;
             g->render_radius = radius;
             g->delete_radius = radius + 4;
         }
         else {
-            add_message("Viewing distance must be between 1 and 24.");
-        }
+            add_message("Viewing distance must be between 1 and 40.");
+        }
+    }
+    else if (strcmp(buffer, "/stats") == 0) {
+        PoolStats stats;
+        pool_stats(&stats);
+        char text[MAX_TEXT_LENGTH];
+        snprintf(text, MAX_TEXT_LENGTH,
+            "Pool: %lu hits, %lu misses, %dKB retained",
+            stats.hits, stats.misses, (int)(stats.retained / 1024));
+        add_message(text);
+        double average = g->edit_count ?
+            g->edit_latency / g->edit_count : 0;
+        snprintf(text, MAX_TEXT_LENGTH,
+            "Edits: %d remeshes, %.1fms average, %.1fms max latency",
+            g->edit_count, average * 1000, g->edit_latency_max * 1000);
+        add_message(text);
+        snprintf(text, MAX_TEXT_LENGTH,
+            "Uploads: %d meshes deferred, %d waiting",
+            g->upload_deferred, g->jobs.ready_count);
+        add_message(text);
     }
     else if (strcmp(buffer, "/copy") == 0) {
         copy();
@@ -2439,6 +3912,9 @@ void handle_movement(double dt) {
         }
     }
     float speed = g->flying ? 20 : 5;
+    g->velocity[0] = vx * speed;
+    g->velocity[1] = vy * speed;
+    g->velocity[2] = vz * speed;
     int estimate = roundf(sqrtf(
         powf(vx * speed, 2) +
         powf(vy * speed + ABS(dy) * 2, 2) +
@@ -2568,6 +4044,7 @@ void parse_buffer(char *buffer) {
 void reset_model() {
     memset(g->chunks, 0, sizeof(Chunk) * MAX_CHUNKS);
     g->chunk_count = 0;
+    memset(g->chunk_index, 0, sizeof(g->chunk_index));
     memset(g->players, 0, sizeof(Player) * MAX_PLAYERS);
     g->player_count = 0;
     g->observe1 = 0;
@@ -2586,6 +4063,7 @@ void reset_model() {
 int main(int argc, char **argv) {
     // INITIALIZATION //
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    pool_init();
     srand(time(NULL));
     rand();
 
@@ -2670,6 +4148,8 @@ int main(int argc, char **argv) {
     block_attrib.extra2 = glGetUniformLocation(program, "daylight");
     block_attrib.extra3 = glGetUniformLocation(program, "fog_distance");
     block_attrib.extra4 = glGetUniformLocation(program, "ortho");
+    block_attrib.extra5 = glGetUniformLocation(program, "unpack");
+    block_attrib.extra6 = glGetUniformLocation(program, "origin");
     block_attrib.camera = glGetUniformLocation(program, "camera");
     block_attrib.timer = glGetUniformLocation(program, "timer");
 
@@ -2717,13 +4197,18 @@ int main(int argc, char **argv) {
     g->sign_radius = RENDER_SIGN_RADIUS;
 
     // INITIALIZE WORKER THREADS
-    for (int i = 0; i < WORKERS; i++) {
+    // one core is left for the main thread
+    g->worker_count = MAX(1, MIN(cpu_count() - 1, MAX_WORKERS));
+    JobQueue *jobs = &g->jobs;
+    mtx_init(&jobs->mtx, mtx_plain);
+    cnd_init(&jobs->cnd);
+    jobs->capacity = g->worker_count * JOBS_PER_WORKER;
+    for (int i = 0; i < jobs->capacity; i++) {
+        jobs->free[jobs->free_count++] = jobs->items + i;
+    }
+    for (int i = 0; i < g->worker_count; i++) {
         Worker *worker = g->workers + i;
-        worker->index = i;
-        worker->state = WORKER_IDLE;
-        mtx_init(&worker->mtx, mtx_plain);
-        cnd_init(&worker->cnd);
-        thrd_create(&worker->thrd, worker_run, worker);
+        thrd_create(&worker->thrd, worker_run, jobs);
     }
 
     // OUTER LOOP //
@@ -2822,6 +4307,7 @@ int main(int argc, char **argv) {
             g->observe1 = g->observe1 % g->player_count;
             g->observe2 = g->observe2 % g->player_count;
             delete_chunks();
+            update_chunks(me);
             del_buffer(me->buffer);
             me->buffer = gen_player_buffer(s->x, s->y, s->z, s->rx, s->ry);
             for (int i = 1; i < g->player_count; i++) {
@@ -2948,12 +4434,13 @@ int main(int argc, char **argv) {
 
         // SHUTDOWN //
         db_save_state(s->x, s->y, s->z, s->rx, s->ry);
+        delete_all_chunks();
+        wait_jobs();
         db_close();
         db_disable();
         client_stop();
         client_disable();
         del_buffer(sky_buffer);
-        delete_all_chunks();
         delete_all_players();
     }
 
@@ -1,8 +1,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "map.h"
+#include "pool.h"
 
-int hash_int(int key) {
+#define MAP_MIN_MASK 0xf
+
+unsigned int hash_int(unsigned int key) {
     key = ~key + (key << 15);
     key = key ^ (key >> 12);
     key = key + (key << 2);
@@ -12,11 +15,14 @@ int hash_int(int key) {
     return key;
 }
 
-int hash(int x, int y, int z) {
-    x = hash_int(x);
-    y = hash_int(y);
-    z = hash_int(z);
-    return x ^ y ^ z;
+unsigned int hash(int x, int y, int z) {
+    unsigned int h = hash_int(x);
+    h = hash_int(h + y);
+    return hash_int(h + z);
+}
+
+MapSlot *map_data_alloc(unsigned int mask) {
+    return (MapSlot *)pool_calloc((mask + 1) * sizeof(MapSlot));
 }
 
 void map_alloc(Map *map, int dx, int dy, int dz, int mask) {
@@ -25,11 +31,18 @@ void map_alloc(Map *map, int dx, int dy, int dz, int mask) {
     map->dz = dz;
     map->mask = mask;
     map->size = 0;
-    map->data = (MapEntry *)calloc(map->mask + 1, sizeof(MapEntry));
+    map->data = map_data_alloc(map->mask);
+    map->refs = 0;
 }
 
 void map_free(Map *map) {
-    free(map->data);
+    if (map->refs) {
+        if (--(*map->refs)) {
+            return;
+        }
+        free(map->refs);
+    }
+    pool_free(map->data);
 }
 
 void map_copy(Map *dst, Map *src) {
@@ -38,77 +51,190 @@ void map_copy(Map *dst, Map *src) {
     dst->dz = src->dz;
     dst->mask = src->mask;
     dst->size = src->size;
-    dst->data = (MapEntry *)calloc(dst->mask + 1, sizeof(MapEntry));
-    memcpy(dst->data, src->data, (dst->mask + 1) * sizeof(MapEntry));
+    dst->data = (MapSlot *)pool_alloc((dst->mask + 1) * sizeof(MapSlot));
+    memcpy(dst->data, src->data, (dst->mask + 1) * sizeof(MapSlot));
+    dst->refs = 0;
 }
 
-int map_set(Map *map, int x, int y, int z, int w) {
-    unsigned int index = hash(x, y, z) & map->mask;
-    x -= map->dx;
-    y -= map->dy;
-    z -= map->dz;
-    MapEntry *entry = map->data + index;
-    int overwrite = 0;
-    while (!EMPTY_ENTRY(entry)) {
-        if (entry->e.x == x && entry->e.y == y && entry->e.z == z) {
-            overwrite = 1;
-            break;
-        }
-        index = (index + 1) & map->mask;
-        entry = map->data + index;
+void map_share(Map *dst, Map *src) {
+    if (!src->refs) {
+        src->refs = (unsigned int *)malloc(sizeof(unsigned int));
+        *src->refs = 1;
     }
-    if (overwrite) {
-        if (entry->e.w != w) {
-            entry->e.w = w;
-            return 1;
-        }
-    }
-    else if (w) {
-        entry->e.x = x;
-        entry->e.y = y;
-        entry->e.z = z;
-        entry->e.w = w;
-        map->size++;
-        if (map->size * 2 > map->mask) {
-            map_grow(map);
-        }
-        return 1;
+    (*src->refs)++;
+    memcpy(dst, src, sizeof(Map));
+}
+
+void map_move(Map *dst, Map *src) {
+    memcpy(dst, src, sizeof(Map));
+    src->size = 0;
+    src->data = 0;
+    src->refs = 0;
+}
+
+void map_unshare(Map *map) {
+    if (map->refs && *map->refs > 1) {
+        Map src = *map;
+        (*map->refs)--;
+        map_copy(map, &src);
     }
-    return 0;
 }
 
-int map_get(Map *map, int x, int y, int z) {
-    unsigned int index = hash(x, y, z) & map->mask;
-    x -= map->dx;
-    y -= map->dy;
-    z -= map->dz;
-    if (x < 0 || x > 255) return 0;
-    if (y < 0 || y > 255) return 0;
-    if (z < 0 || z > 255) return 0;
-    MapEntry *entry = map->data + index;
-    while (!EMPTY_ENTRY(entry)) {
-        if (entry->e.x == x && entry->e.y == y && entry->e.z == z) {
-            return entry->e.w;
+// robin hood insert of an entry known not to be present, no growth check
+void map_insert(Map *map, MapSlot slot) {
+    unsigned int index = slot.hash & map->mask;
+    unsigned int distance = 0;
+    while (!EMPTY_ENTRY(&map->data[index].entry)) {
+        unsigned int other = (index - map->data[index].hash) & map->mask;
+        if (other < distance) {
+            MapSlot swap = map->data[index];
+            map->data[index] = slot;
+            slot = swap;
+            distance = other;
         }
         index = (index + 1) & map->mask;
-        entry = map->data + index;
+        distance++;
     }
-    return 0;
+    map->data[index] = slot;
+    map->size++;
 }
 
-void map_grow(Map *map) {
+void map_resize(Map *map, unsigned int mask) {
     Map new_map;
     new_map.dx = map->dx;
     new_map.dy = map->dy;
     new_map.dz = map->dz;
-    new_map.mask = (map->mask << 1) | 1;
+    new_map.mask = mask;
     new_map.size = 0;
-    new_map.data = (MapEntry *)calloc(new_map.mask + 1, sizeof(MapEntry));
-    MAP_FOR_EACH(map, ex, ey, ez, ew) {
-        map_set(&new_map, ex, ey, ez, ew);
-    } END_MAP_FOR_EACH;
-    free(map->data);
+    new_map.data = map_data_alloc(new_map.mask);
+    new_map.refs = 0;
+    for (unsigned int i = 0; i <= map->mask; i++) {
+        if (!EMPTY_ENTRY(&map->data[i].entry)) {
+            map_insert(&new_map, map->data[i]);
+        }
+    }
+    map_free(map);
+    map->refs = 0;
     map->mask = new_map.mask;
     map->size = new_map.size;
     map->data = new_map.data;
 }
+
+void map_grow(Map *map) {
+    map_resize(map, (map->mask << 1) | 1);
+}
+
+void map_reserve(Map *map, unsigned int count) {
+    unsigned int mask = map->mask;
+    while (count * 4 > (mask + 1) * 3) {
+        mask = (mask << 1) | 1;
+    }
+    if (mask != map->mask) {
+        map_resize(map, mask);
+    }
+}
+
+void map_remove(Map *map, unsigned int index) {
+    unsigned int next = (index + 1) & map->mask;
+    while (!EMPTY_ENTRY(&map->data[next].entry) &&
+        ((next - map->data[next].hash) & map->mask))
+    {
+        map->data[index] = map->data[next];
+        index = next;
+        next = (next + 1) & map->mask;
+    }
+    map->data[index].entry.value = 0;
+    map->size--;
+}
+
+void map_shrink(Map *map) {
+    unsigned int mask = map->mask;
+    while (mask > MAP_MIN_MASK && map->size * 8 < mask + 1) {
+        mask >>= 1;
+    }
+    if (mask != map->mask) {
+        map_resize(map, mask);
+    }
+}
+
+int map_find(Map *map, unsigned int h, int x, int y, int z) {
+    unsigned int index = h & map->mask;
+    unsigned int distance = 0;
+    while (!EMPTY_ENTRY(&map->data[index].entry)) {
+        MapSlot *slot = map->data + index;
+        if (slot->hash == h) {
+            MapEntry *entry = &slot->entry;
+            if (entry->e.x == x && entry->e.y == y && entry->e.z == z) {
+                return index;
+            }
+        }
+        if (((index - slot->hash) & map->mask) < distance) {
+            break;
+        }
+        index = (index + 1) & map->mask;
+        distance++;
+    }
+    return -1;
+}
+
+int map_put(Map *map, int x, int y, int z, int w, int reserved) {
+    unsigned int h = hash(x, y, z);
+    x -= map->dx;
+    y -= map->dy;
+    z -= map->dz;
+    MapSlot slot;
+    slot.entry.e.x = x;
+    slot.entry.e.y = y;
+    slot.entry.e.z = z;
+    slot.entry.e.w = w;
+    slot.hash = h;
+    MapEntry *entry = &slot.entry;
+    int index = map_find(map, h, entry->e.x, entry->e.y, entry->e.z);
+    if (index >= 0) {
+        if (map->data[index].entry.e.w == w) {
+            return 0;
+        }
+        map_unshare(map);
+        if (w) {
+            map->data[index].entry.e.w = w;
+        }
+        else {
+            map_remove(map, index);
+            if (!reserved) {
+                map_shrink(map);
+            }
+        }
+        return 1;
+    }
+    if (!w) {
+        return 0;
+    }
+    map_unshare(map);
+    if (!reserved) {
+        map_reserve(map, map->size + 1);
+    }
+    map_insert(map, slot);
+    return 1;
+}
+
+int map_set(Map *map, int x, int y, int z, int w) {
+    return map_put(map, x, y, z, w, 0);
+}
+
+// sets an entry of a bulk load that map_reserve made room for, skipping
+// the growth check. removing entries does not shrink the map meanwhile.
+int map_set_reserved(Map *map, int x, int y, int z, int w) {
+    return map_put(map, x, y, z, w, 1);
+}
+
+int map_get(Map *map, int x, int y, int z) {
+    unsigned int h = hash(x, y, z);
+    x -= map->dx;
+    y -= map->dy;
+    z -= map->dz;
+    if (x < 0 || x > 255) return 0;
+    if (y < 0 || y > 255) return 0;
+    if (z < 0 || z > 255) return 0;
+    int index = map_find(map, h, x, y, z);
+    return index < 0 ? 0 : map->data[index].entry.e.w;
+}
@@ -5,7 +5,7 @@
 
 #define MAP_FOR_EACH(map, ex, ey, ez, ew) \
     for (unsigned int i = 0; i <= map->mask; i++) { \
-        MapEntry *entry = map->data + i; \
+        MapEntry *entry = &map->data[i].entry; \
         if (EMPTY_ENTRY(entry)) { \
             continue; \
         } \
@@ -26,20 +26,30 @@ typedef union {
     } e;
 } MapEntry;
 
+typedef struct {
+    MapEntry entry;
+    unsigned int hash;
+} MapSlot;
+
 typedef struct {
     int dx;
     int dy;
     int dz;
     unsigned int mask;
     unsigned int size;
-    MapEntry *data;
+    MapSlot *data;
+    unsigned int *refs;
 } Map;
 
 void map_alloc(Map *map, int dx, int dy, int dz, int mask);
 void map_free(Map *map);
 void map_copy(Map *dst, Map *src);
+void map_share(Map *dst, Map *src);
+void map_move(Map *dst, Map *src);
 void map_grow(Map *map);
+void map_reserve(Map *map, unsigned int count);
 int map_set(Map *map, int x, int y, int z, int w);
+int map_set_reserved(Map *map, int x, int y, int z, int w);
 int map_get(Map *map, int x, int y, int z);
 
 #endif
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "pool.h"
+#include "tinycthread.h"
+
+#define POOL_CLASSES 64
+#define POOL_MIN_BUFFER 256
+
+typedef union PoolHeader {
+    size_t size;
+    union PoolHeader *next;
+    double align[2];
+} PoolHeader;
+
+typedef struct {
+    size_t size;
+    PoolHeader *head;
+} PoolClass;
+
+static mtx_t pool_mtx;
+static PoolClass pool_classes[POOL_CLASSES];
+static int pool_class_count;
+static PoolStats pool_totals;
+
+void pool_init() {
+    mtx_init(&pool_mtx, mtx_plain);
+}
+
+PoolClass *pool_class(size_t size, int create) {
+    for (int i = 0; i < pool_class_count; i++) {
+        if (pool_classes[i].size == size) {
+            return pool_classes + i;
+        }
+    }
+    if (!create || pool_class_count == POOL_CLASSES) {
+        return 0;
+    }
+    PoolClass *pool = pool_classes + pool_class_count++;
+    pool->size = size;
+    pool->head = 0;
+    return pool;
+}
+
+void *pool_alloc(size_t size) {
+    PoolHeader *header = 0;
+    mtx_lock(&pool_mtx);
+    PoolClass *pool = pool_class(size, 0);
+    if (pool && pool->head) {
+        header = pool->head;
+        pool->head = header->next;
+        pool_totals.retained -= size;
+        pool_totals.hits++;
+    }
+    else {
+        pool_totals.misses++;
+    }
+    mtx_unlock(&pool_mtx);
+    if (!header) {
+        header = (PoolHeader *)malloc(sizeof(PoolHeader) + size);
+    }
+    header->size = size;
+    return header + 1;
+}
+
+void *pool_calloc(size_t size) {
+    void *ptr = pool_alloc(size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void *pool_alloc_buffer(size_t size) {
+    size_t rounded = POOL_MIN_BUFFER;
+    while (rounded < size) {
+        rounded <<= 1;
+    }
+    return pool_alloc(rounded);
+}
+
+void pool_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    PoolHeader *header = (PoolHeader *)ptr - 1;
+    size_t size = header->size;
+    mtx_lock(&pool_mtx);
+    PoolClass *pool = 0;
+    if (pool_totals.retained + size <= POOL_MAX_RETAINED) {
+        pool = pool_class(size, 1);
+    }
+    if (pool) {
+        header->next = pool->head;
+        pool->head = header;
+        pool_totals.retained += size;
+    }
+    mtx_unlock(&pool_mtx);
+    if (!pool) {
+        free(header);
+    }
+}
+
+void pool_stats(PoolStats *stats) {
+    mtx_lock(&pool_mtx);
+    memcpy(stats, &pool_totals, sizeof(PoolStats));
+    mtx_unlock(&pool_mtx);
+}
@@ -0,0 +1,19 @@
+#ifndef _pool_h_
+#define _pool_h_
+
+#include <stddef.h>
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    size_t retained;
+} PoolStats;
+
+void pool_init();
+void *pool_alloc(size_t size);
+void *pool_calloc(size_t size);
+void *pool_alloc_buffer(size_t size);
+void pool_free(void *ptr);
+void pool_stats(PoolStats *stats);
+
+#endif
@@ -1,22 +1,23 @@
 #include <stdlib.h>
 #include <string.h>
+#include "pool.h"
 #include "sign.h"
 
 void sign_list_alloc(SignList *list, int capacity) {
     list->capacity = capacity;
     list->size = 0;
-    list->data = (Sign *)calloc(capacity, sizeof(Sign));
+    list->data = (Sign *)pool_calloc(capacity * sizeof(Sign));
 }
 
 void sign_list_free(SignList *list) {
-    free(list->data);
+    pool_free(list->data);
 }
 
 void sign_list_grow(SignList *list) {
     SignList new_list;
     sign_list_alloc(&new_list, list->capacity * 2);
     memcpy(new_list.data, list->data, list->size * sizeof(Sign));
-    free(list->data);
+    pool_free(list->data);
     list->capacity = new_list.capacity;
     list->data = new_list.data;
 }
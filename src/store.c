@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include "item.h"
+#include "pool.h"
+#include "store.h"
+
+int section_words(int shift) {
+    return (SECTION_VOLUME << shift) / 32;
+}
+
+Section *section_alloc() {
+    Section *section = (Section *)pool_calloc(sizeof(Section));
+    section->refs = 1;
+    section->shift = 0;
+    section->mask = 1;
+    section->palette_size = 1;
+    section->counts[0] = SECTION_VOLUME;
+    section->data = (unsigned int *)pool_calloc(
+        section_words(section->shift) * sizeof(unsigned int));
+    return section;
+}
+
+void section_free(Section *section) {
+    if (--section->refs) {
+        return;
+    }
+    pool_free(section->data);
+    pool_free(section);
+}
+
+Section *section_copy(Section *src) {
+    Section *dst = (Section *)pool_alloc(sizeof(Section));
+    memcpy(dst, src, sizeof(Section));
+    dst->refs = 1;
+    int words = section_words(src->shift);
+    dst->data = (unsigned int *)pool_alloc(words * sizeof(unsigned int));
+    memcpy(dst->data, src->data, words * sizeof(unsigned int));
+    return dst;
+}
+
+void section_put(Section *section, int i, unsigned int index) {
+    unsigned int *word = section->data + (i >> SECTION_WORD_SHIFT(section));
+    int offset = (i & SECTION_WORD_MASK(section)) << section->shift;
+    *word = (*word & ~(section->mask << offset)) | (index << offset);
+}
+
+void section_grow(Section *section) {
+    Section new_section;
+    new_section.shift = section->shift + 1;
+    new_section.mask = (1 << (1 << new_section.shift)) - 1;
+    new_section.data = (unsigned int *)pool_calloc(
+        section_words(new_section.shift) * sizeof(unsigned int));
+    for (int i = 0; i < SECTION_VOLUME; i++) {
+        unsigned int index = SECTION_INDEX(section, i);
+        if (index) {
+            section_put(&new_section, i, index);
+        }
+    }
+    pool_free(section->data);
+    section->shift = new_section.shift;
+    section->mask = new_section.mask;
+    section->data = new_section.data;
+}
+
+unsigned int section_palette_index(Section *section, int w) {
+    unsigned int index = section->lookup[(unsigned char)w];
+    if (index && section->palette[index] == w) {
+        return index;
+    }
+    for (index = 1; index < section->palette_size; index++) {
+        if (section->counts[index] == 0) {
+            break;
+        }
+    }
+    if (index < section->palette_size) {
+        section->lookup[(unsigned char)section->palette[index]] = 0;
+    }
+    else {
+        if (section->palette_size > section->mask) {
+            section_grow(section);
+        }
+        section->palette_size++;
+    }
+    section->palette[index] = w;
+    section->lookup[(unsigned char)w] = index;
+    return index;
+}
+
+int section_set(Section *section, int i, int w) {
+    unsigned int old = SECTION_INDEX(section, i);
+    if (section->palette[old] == w) {
+        return 0;
+    }
+    unsigned int index = w ? section_palette_index(section, w) : 0;
+    section_put(section, i, index);
+    section->counts[old]--;
+    section->counts[index]++;
+    if (!old) {
+        section->size++;
+    }
+    if (!index) {
+        section->size--;
+    }
+    return 1;
+}
+
+short *heights_alloc() {
+    short *heights = (short *)pool_alloc(SECTION_AREA * 2 * sizeof(short));
+    for (int i = 0; i < SECTION_AREA * 2; i++) {
+        heights[i] = -1;
+    }
+    return heights;
+}
+
+short *heights_copy(short *src) {
+    short *dst = (short *)pool_alloc(SECTION_AREA * 2 * sizeof(short));
+    memcpy(dst, src, SECTION_AREA * 2 * sizeof(short));
+    return dst;
+}
+
+void store_alloc(Store *store, int dx, int dy, int dz) {
+    store->dx = dx;
+    store->dy = dy;
+    store->dz = dz;
+    store->size = 0;
+    memset(store->sections, 0, sizeof(store->sections));
+    store->heights = heights_alloc();
+}
+
+void store_free(Store *store) {
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        if (store->sections[i]) {
+            section_free(store->sections[i]);
+            store->sections[i] = 0;
+        }
+    }
+    store->size = 0;
+    pool_free(store->heights);
+    store->heights = 0;
+}
+
+void store_copy(Store *dst, Store *src) {
+    store_alloc(dst, src->dx, src->dy, src->dz);
+    dst->size = src->size;
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        if (src->sections[i]) {
+            dst->sections[i] = section_copy(src->sections[i]);
+        }
+    }
+    memcpy(dst->heights, src->heights, SECTION_AREA * 2 * sizeof(short));
+}
+
+void store_share(Store *dst, Store *src) {
+    memcpy(dst, src, sizeof(Store));
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        if (src->sections[i]) {
+            src->sections[i]->refs++;
+        }
+    }
+    dst->heights = heights_copy(src->heights);
+}
+
+void store_move(Store *dst, Store *src) {
+    memcpy(dst, src, sizeof(Store));
+    src->size = 0;
+    memset(src->sections, 0, sizeof(src->sections));
+    src->heights = 0;
+}
+
+void store_update_height(Store *store, short *height, int x, int y, int z,
+    int test, int (*func)(int))
+{
+    if (test && y > *height) {
+        *height = y;
+    }
+    else if (!test && y == *height) {
+        for (y--; y >= 0; y--) {
+            if (func(store_get(store, x, y, z))) {
+                break;
+            }
+        }
+        *height = y;
+    }
+}
+
+int is_opaque(int w) {
+    return !is_transparent(w);
+}
+
+int store_set(Store *store, int x, int y, int z, int w) {
+    x -= store->dx;
+    y -= store->dy;
+    z -= store->dz;
+    if (x < 0 || x >= SECTION_XZ) return 0;
+    if (y < 0 || y >= STORE_HEIGHT) return 0;
+    if (z < 0 || z >= SECTION_XZ) return 0;
+    Section **slot = store->sections + y / SECTION_Y;
+    if (!*slot) {
+        if (!w) {
+            return 0;
+        }
+        *slot = section_alloc();
+    }
+    Section *section = *slot;
+    int i = ((y % SECTION_Y) * SECTION_XZ + x) * SECTION_XZ + z;
+    if (section->palette[SECTION_INDEX(section, i)] == w) {
+        return 0;
+    }
+    if (section->refs > 1) {
+        section->refs--;
+        section = *slot = section_copy(section);
+    }
+    unsigned int size = section->size;
+    if (!section_set(section, i, w)) {
+        return 0;
+    }
+    store->size -= size;
+    store->size += section->size;
+    if (!section->size) {
+        section_free(section);
+        *slot = 0;
+    }
+    if (store->heights) {
+        int i = x * SECTION_XZ + z;
+        x += store->dx;
+        y += store->dy;
+        z += store->dz;
+        store_update_height(store, store->heights + i,
+            x, y, z, is_opaque(w), is_opaque);
+        store_update_height(store, store->heights + SECTION_AREA + i,
+            x, y, z, is_obstacle(w), is_obstacle);
+    }
+    return 1;
+}
+
+int store_get(Store *store, int x, int y, int z) {
+    x -= store->dx;
+    y -= store->dy;
+    z -= store->dz;
+    if (x < 0 || x >= SECTION_XZ) return 0;
+    if (y < 0 || y >= STORE_HEIGHT) return 0;
+    if (z < 0 || z >= SECTION_XZ) return 0;
+    Section *section = store->sections[y / SECTION_Y];
+    if (!section) {
+        return 0;
+    }
+    int i = ((y % SECTION_Y) * SECTION_XZ + x) * SECTION_XZ + z;
+    return section->palette[SECTION_INDEX(section, i)];
+}
+
+int store_height(Store *store, int x, int z, int offset) {
+    x -= store->dx;
+    z -= store->dz;
+    if (x < 0 || x >= SECTION_XZ) return -1;
+    if (z < 0 || z >= SECTION_XZ) return -1;
+    return store->heights[offset + x * SECTION_XZ + z];
+}
+
+int store_opaque_height(Store *store, int x, int z) {
+    return store_height(store, x, z, 0);
+}
+
+int store_obstacle_height(Store *store, int x, int z) {
+    return store_height(store, x, z, SECTION_AREA);
+}
+
+void store_from_map(Store *store, Map *map) {
+    MAP_FOR_EACH(map, ex, ey, ez, ew) {
+        store_set(store, ex, ey, ez, ew);
+    } END_MAP_FOR_EACH;
+}
+
+void store_to_map(Store *store, Map *map) {
+    STORE_FOR_EACH(store, ex, ey, ez, ew) {
+        map_set(map, ex, ey, ez, ew);
+    } END_STORE_FOR_EACH;
+}
@@ -0,0 +1,82 @@
+#ifndef _store_h_
+#define _store_h_
+
+#include "config.h"
+#include "map.h"
+
+#define SECTION_XZ (CHUNK_SIZE + 2)
+#define SECTION_Y 16
+#define SECTION_AREA (SECTION_XZ * SECTION_XZ)
+#define SECTION_VOLUME (SECTION_AREA * SECTION_Y)
+#define STORE_SECTIONS 16
+#define STORE_HEIGHT (SECTION_Y * STORE_SECTIONS)
+
+#define SECTION_WORD_SHIFT(section) (5 - (section)->shift)
+#define SECTION_WORD_MASK(section) ((1 << SECTION_WORD_SHIFT(section)) - 1)
+
+#define SECTION_INDEX(section, i) \
+    (((section)->data[(i) >> SECTION_WORD_SHIFT(section)] >> \
+    (((i) & SECTION_WORD_MASK(section)) << (section)->shift)) & \
+    (section)->mask)
+
+#define STORE_FOR_EACH(store, ex, ey, ez, ew) \
+    STORE_FOR_EACH_SECTIONS(store, 0, STORE_SECTIONS - 1, ex, ey, ez, ew)
+
+#define STORE_FOR_EACH_SECTIONS(store, first, last, ex, ey, ez, ew) \
+    for (int section_y = (first); section_y <= (last); section_y++) { \
+        Section *section = (store)->sections[section_y]; \
+        if (!section) { \
+            continue; \
+        } \
+        for (int voxel = 0; voxel < SECTION_VOLUME; voxel++) { \
+            if (!(voxel & SECTION_WORD_MASK(section)) && \
+                !section->data[voxel >> SECTION_WORD_SHIFT(section)]) \
+            { \
+                voxel += SECTION_WORD_MASK(section); \
+                continue; \
+            } \
+            int ew = section->palette[SECTION_INDEX(section, voxel)]; \
+            if (!ew) { \
+                continue; \
+            } \
+            int ex = (store)->dx + voxel / SECTION_XZ % SECTION_XZ; \
+            int ey = (store)->dy + section_y * SECTION_Y + \
+                voxel / SECTION_AREA; \
+            int ez = (store)->dz + voxel % SECTION_XZ;
+
+#define END_STORE_FOR_EACH } }
+
+typedef struct {
+    unsigned int refs;
+    unsigned int size;
+    unsigned int shift;
+    unsigned int mask;
+    unsigned int palette_size;
+    char palette[256];
+    unsigned char lookup[256];
+    unsigned short counts[256];
+    unsigned int *data;
+} Section;
+
+typedef struct {
+    int dx;
+    int dy;
+    int dz;
+    unsigned int size;
+    Section *sections[STORE_SECTIONS];
+    short *heights;
+} Store;
+
+void store_alloc(Store *store, int dx, int dy, int dz);
+void store_free(Store *store);
+void store_copy(Store *dst, Store *src);
+void store_share(Store *dst, Store *src);
+void store_move(Store *dst, Store *src);
+int store_set(Store *store, int x, int y, int z, int w);
+int store_get(Store *store, int x, int y, int z);
+int store_opaque_height(Store *store, int x, int z);
+int store_obstacle_height(Store *store, int x, int z);
+void store_from_map(Store *store, Map *map);
+void store_to_map(Store *store, Map *map);
+
+#endif
@@ -1,9 +1,16 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "lodepng.h"
 #include "matrix.h"
+#include "pool.h"
 #include "util.h"
 
 int rand_int(int n) {
@@ -16,6 +23,17 @@ double rand_double() {
     return (double)rand() / (double)RAND_MAX;
 }
 
+int cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
 void update_fps(FPS *fps) {
     fps->frames++;
     double now = glfwGetTime();
@@ -56,16 +74,77 @@ void del_buffer(GLuint buffer) {
 }
 
 GLfloat *malloc_faces(int components, int faces) {
-    return malloc(sizeof(GLfloat) * 6 * components * faces);
+    return pool_alloc_buffer(sizeof(GLfloat) * 6 * components * faces);
 }
 
 GLuint gen_faces(int components, int faces, GLfloat *data) {
     GLuint buffer = gen_buffer(
         sizeof(GLfloat) * 6 * components * faces, data);
+    pool_free(data);
+    return buffer;
+}
+
+GLfloat *malloc_quads(int components, int faces) {
+    return pool_alloc_buffer(sizeof(GLfloat) * 4 * components * faces);
+}
+
+GLuint gen_quads(int components, int faces, GLfloat *data) {
+    GLuint buffer = gen_buffer(
+        sizeof(GLfloat) * 4 * components * faces, data);
+    pool_free(data);
+    return buffer;
+}
+
+GLuint gen_quad_indices(int faces) {
+    GLuint *data = malloc(sizeof(GLuint) * 6 * faces);
+    for (int i = 0; i < faces; i++) {
+        GLuint *d = data + i * 6;
+        GLuint v = i * 4;
+        d[0] = v;
+        d[1] = v + 1;
+        d[2] = v + 2;
+        d[3] = v;
+        d[4] = v + 2;
+        d[5] = v + 3;
+    }
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+        sizeof(GLuint) * 6 * faces, data, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     free(data);
     return buffer;
 }
 
+void face_buffer_alloc(
+    FaceBuffer *buffer, int components, int vertices, int capacity)
+{
+    buffer->components = components;
+    buffer->vertices = vertices;
+    buffer->capacity = capacity;
+    buffer->size = 0;
+    buffer->data = pool_alloc_buffer(
+        sizeof(GLfloat) * vertices * components * capacity);
+}
+
+GLfloat *face_buffer_reserve(FaceBuffer *buffer, int faces) {
+    int stride = buffer->vertices * buffer->components;
+    if (buffer->size + faces > buffer->capacity) {
+        int capacity = MAX(buffer->capacity, 1) * 2;
+        while (buffer->size + faces > capacity) {
+            capacity *= 2;
+        }
+        GLfloat *data = pool_alloc_buffer(
+            sizeof(GLfloat) * stride * capacity);
+        memcpy(data, buffer->data, sizeof(GLfloat) * stride * buffer->size);
+        pool_free(buffer->data);
+        buffer->capacity = capacity;
+        buffer->data = data;
+    }
+    return buffer->data + stride * buffer->size;
+}
+
 GLuint make_shader(GLenum type, const char *source) {
     GLuint shader = glCreateShader(type);
     glShaderSource(shader, 1, &source, NULL);
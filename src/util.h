@@ -25,14 +25,29 @@ typedef struct {
     double since;
 } FPS;
 
+typedef struct {
+    int components;
+    int vertices;
+    int capacity;
+    int size;
+    GLfloat *data;
+} FaceBuffer;
+
 int rand_int(int n);
 double rand_double();
+int cpu_count();
 void update_fps(FPS *fps);
 
 GLuint gen_buffer(GLsizei size, GLfloat *data);
 void del_buffer(GLuint buffer);
 GLfloat *malloc_faces(int components, int faces);
 GLuint gen_faces(int components, int faces, GLfloat *data);
+GLfloat *malloc_quads(int components, int faces);
+GLuint gen_quads(int components, int faces, GLfloat *data);
+GLuint gen_quad_indices(int faces);
+void face_buffer_alloc(
+    FaceBuffer *buffer, int components, int vertices, int capacity);
+GLfloat *face_buffer_reserve(FaceBuffer *buffer, int faces);
 GLuint make_shader(GLenum type, const char *source);
 GLuint load_shader(GLenum type, const char *path);
 GLuint make_program(GLuint shader1, GLuint shader2);
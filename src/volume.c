@@ -0,0 +1,94 @@
+#include <string.h>
+#include "pool.h"
+#include "volume.h"
+
+void volume_section_free(VolumeSection *section) {
+    if (--section->refs) {
+        return;
+    }
+    pool_free(section);
+}
+
+void volume_alloc(Volume *volume, int dx, int dy, int dz) {
+    volume->dx = dx;
+    volume->dy = dy;
+    volume->dz = dz;
+    volume->size = 0;
+    memset(volume->sections, 0, sizeof(volume->sections));
+}
+
+void volume_free(Volume *volume) {
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        if (volume->sections[i]) {
+            volume_section_free(volume->sections[i]);
+            volume->sections[i] = 0;
+        }
+    }
+    volume->size = 0;
+}
+
+void volume_share(Volume *dst, Volume *src) {
+    memcpy(dst, src, sizeof(Volume));
+    for (int i = 0; i < STORE_SECTIONS; i++) {
+        if (src->sections[i]) {
+            src->sections[i]->refs++;
+        }
+    }
+}
+
+VolumeSection *volume_section_copy(VolumeSection *src) {
+    VolumeSection *dst = (VolumeSection *)pool_alloc(sizeof(VolumeSection));
+    memcpy(dst, src, sizeof(VolumeSection));
+    dst->refs = 1;
+    return dst;
+}
+
+int volume_set(Volume *volume, int x, int y, int z, int w) {
+    x -= volume->dx;
+    y -= volume->dy;
+    z -= volume->dz;
+    if (x < 0 || x >= CHUNK_SIZE) return 0;
+    if (y < 0 || y >= STORE_HEIGHT) return 0;
+    if (z < 0 || z >= CHUNK_SIZE) return 0;
+    VolumeSection **slot = volume->sections + y / SECTION_Y;
+    if (!*slot) {
+        if (!w) {
+            return 0;
+        }
+        *slot = (VolumeSection *)pool_calloc(sizeof(VolumeSection));
+        (*slot)->refs = 1;
+    }
+    VolumeSection *section = *slot;
+    int i = ((y % SECTION_Y) * CHUNK_SIZE + x) * CHUNK_SIZE + z;
+    if (section->data[i] == w) {
+        return 0;
+    }
+    if (section->refs > 1) {
+        section->refs--;
+        section = *slot = volume_section_copy(section);
+    }
+    int size = (w != 0) - (section->data[i] != 0);
+    section->data[i] = w;
+    section->size += size;
+    volume->size += size;
+    if (!section->size) {
+        volume_section_free(section);
+        *slot = 0;
+    }
+    return 1;
+}
+
+int volume_get(Volume *volume, int x, int y, int z) {
+    x -= volume->dx;
+    y -= volume->dy;
+    z -= volume->dz;
+    if (x < 0 || x >= CHUNK_SIZE) return 0;
+    if (y < 0 || y >= STORE_HEIGHT) return 0;
+    if (z < 0 || z >= CHUNK_SIZE) return 0;
+    VolumeSection *section = volume->sections[y / SECTION_Y];
+    if (!section) {
+        return 0;
+    }
+    int i = ((y % SECTION_Y) * CHUNK_SIZE + x) * CHUNK_SIZE + z;
+    return section->data[i];
+}
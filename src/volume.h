@@ -0,0 +1,30 @@
+#ifndef _volume_h_
+#define _volume_h_
+
+#include "config.h"
+#include "store.h"
+
+#define VOLUME_AREA (CHUNK_SIZE * CHUNK_SIZE)
+#define VOLUME_SECTION_SIZE (VOLUME_AREA * SECTION_Y)
+
+typedef struct {
+    unsigned int refs;
+    unsigned int size;
+    unsigned char data[VOLUME_SECTION_SIZE];
+} VolumeSection;
+
+typedef struct {
+    int dx;
+    int dy;
+    int dz;
+    unsigned int size;
+    VolumeSection *sections[STORE_SECTIONS];
+} Volume;
+
+void volume_alloc(Volume *volume, int dx, int dy, int dz);
+void volume_free(Volume *volume);
+void volume_share(Volume *dst, Volume *src);
+int volume_set(Volume *volume, int x, int y, int z, int w);
+int volume_get(Volume *volume, int x, int y, int z);
+
+#endif
@@ -0,0 +1,193 @@
+// Compares the breadth first light fill against the recursive fill it
+// replaced, over random blocks and light sources in a 3x3 group of chunks,
+// when the chunks load, after random block and light edits, and when a
+// chunk is deleted and loaded again.
+
+#define main craft_main
+#include "../src/main.c"
+#undef main
+
+#define TRIALS 20
+#define SOURCES 40
+#define EDITS 60
+#define RELOADS 4
+#define HEIGHT 48
+#define RANGE (CHUNK_SIZE * 3)
+#define ORIGIN (-CHUNK_SIZE)
+#define REF(x, y, z) \
+    (((y) * RANGE + (z) - ORIGIN) * RANGE + (x) - ORIGIN)
+
+static char reference[RANGE * RANGE * STORE_HEIGHT];
+
+// the fill light levels were computed with before the breadth first queue
+void reference_fill(int x, int y, int z, int w, int force) {
+    if (x < ORIGIN || x >= ORIGIN + RANGE) {
+        return;
+    }
+    if (z < ORIGIN || z >= ORIGIN + RANGE) {
+        return;
+    }
+    if (y < 0 || y >= STORE_HEIGHT) {
+        return;
+    }
+    if (!find_chunk(chunked(x), chunked(z))->loaded) {
+        return;
+    }
+    if (reference[REF(x, y, z)] >= w) {
+        return;
+    }
+    if (!force && !is_transparent(get_block(x, y, z))) {
+        return;
+    }
+    reference[REF(x, y, z)] = w--;
+    reference_fill(x - 1, y, z, w, 0);
+    reference_fill(x + 1, y, z, w, 0);
+    reference_fill(x, y - 1, z, w, 0);
+    reference_fill(x, y + 1, z, w, 0);
+    reference_fill(x, y, z - 1, w, 0);
+    reference_fill(x, y, z + 1, w, 0);
+}
+
+int random_block() {
+    int r = rand_int(10);
+    return r < 3 ? STONE : r < 4 ? GLASS : EMPTY;
+}
+
+void create_chunks() {
+    for (int p = -1; p <= 1; p++) {
+        for (int q = -1; q <= 1; q++) {
+            Chunk *chunk = g->chunks + g->chunk_count++;
+            init_chunk(chunk, p, q);
+            for (int x = 0; x < CHUNK_SIZE; x++) {
+                for (int z = 0; z < CHUNK_SIZE; z++) {
+                    for (int y = 0; y < HEIGHT; y++) {
+                        store_set(&chunk->blocks,
+                            p * CHUNK_SIZE + x, y, q * CHUNK_SIZE + z,
+                            random_block());
+                    }
+                }
+            }
+        }
+    }
+    for (int i = 0; i < SOURCES; i++) {
+        int x = ORIGIN + rand_int(RANGE);
+        int y = rand_int(HEIGHT);
+        int z = ORIGIN + rand_int(RANGE);
+        Chunk *chunk = find_chunk(chunked(x), chunked(z));
+        map_set(&chunk->lights, x, y, z, 1 + rand_int(15));
+    }
+    // chunks are lit one at a time as they load, in any order
+    int order[9];
+    for (int i = 0; i < 9; i++) {
+        order[i] = i;
+    }
+    for (int i = 8; i > 0; i--) {
+        int j = rand_int(i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (int i = 0; i < 9; i++) {
+        Chunk *chunk = g->chunks + order[i];
+        chunk->loaded = 1;
+        light_chunk(chunk);
+    }
+}
+
+void delete_chunks_only() {
+    for (int i = 0; i < g->chunk_count; i++) {
+        Chunk *chunk = g->chunks + i;
+        store_free(&chunk->blocks);
+        map_free(&chunk->lights);
+        volume_free(&chunk->light_levels);
+        sign_list_free(&chunk->signs);
+    }
+    g->chunk_count = 0;
+    memset(g->chunk_index, 0, sizeof(g->chunk_index));
+}
+
+void random_edit() {
+    int x = ORIGIN + rand_int(RANGE);
+    int y = rand_int(HEIGHT);
+    int z = ORIGIN + rand_int(RANGE);
+    if (rand_int(3)) {
+        set_block(x, y, z, random_block());
+    }
+    else {
+        set_light(chunked(x), chunked(z), x, y, z, rand_int(16));
+    }
+}
+
+int compare(int trial, const char *stage) {
+    memset(reference, 0, sizeof(reference));
+    for (int i = 0; i < g->chunk_count; i++) {
+        if (!g->chunks[i].loaded) {
+            continue;
+        }
+        Map *map = &g->chunks[i].lights;
+        MAP_FOR_EACH(map, ex, ey, ez, ew) {
+            if (ew > 0) {
+                reference_fill(ex, ey, ez, ew, 1);
+            }
+        } END_MAP_FOR_EACH;
+    }
+    for (int x = ORIGIN; x < ORIGIN + RANGE; x++) {
+        for (int z = ORIGIN; z < ORIGIN + RANGE; z++) {
+            Chunk *chunk = find_chunk(chunked(x), chunked(z));
+            if (!chunk->loaded) {
+                continue;
+            }
+            for (int y = 0; y < STORE_HEIGHT; y++) {
+                int expected = reference[REF(x, y, z)];
+                int actual = volume_get(&chunk->light_levels, x, y, z);
+                if (actual != expected) {
+                    printf("trial %d, %s: light at %d, %d, %d is %d, "
+                        "expected %d\n",
+                        trial, stage, x, y, z, actual, expected);
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// deletes the light of a chunk, takes its sources away as the server can
+// while it is gone, then loads it again
+int reload_chunk(int trial) {
+    Chunk *chunk = g->chunks + rand_int(g->chunk_count);
+    light_unload(chunk);
+    light_darken(0);
+    light_fill(0);
+    volume_free(&chunk->light_levels);
+    map_free(&chunk->lights);
+    map_alloc(&chunk->lights,
+        chunk->p * CHUNK_SIZE - 1, 0, chunk->q * CHUNK_SIZE - 1, 0xf);
+    int result = compare(trial, "unload");
+    chunk->loaded = 1;
+    light_chunk(chunk);
+    return result && compare(trial, "reload");
+}
+
+int main(int argc, char **argv) {
+    pool_init();
+    int failed = 0;
+    for (int trial = 0; trial < TRIALS; trial++) {
+        srand(trial);
+        create_chunks();
+        failed += !compare(trial, "load");
+        for (int i = 1; i <= EDITS; i++) {
+            random_edit();
+            if (i % 10 == 0) {
+                failed += !compare(trial, "edits");
+            }
+        }
+        for (int i = 0; i < RELOADS; i++) {
+            failed += !reload_chunk(trial);
+        }
+        delete_chunks_only();
+    }
+    printf("light_test: %d of %d comparisons failed\n",
+        failed, TRIALS * (1 + EDITS / 10 + RELOADS));
+    return failed ? 1 : 0;
+}